@@ -0,0 +1,509 @@
+/* Benchmark for the classifier. Results are written on the standard output,
+ * one per line, as tab-separated fields:
+ *
+ *    <model> <labels> <input> <chunk> <metric> <value>
+ *
+ * where <model> and <input> are file names stripped of their leading
+ * directories, <labels> is the number of languages loaded, and <chunk> is the
+ * size of the chunks given to sb_feed(), or "-" if not applicable. Metrics are:
+ *
+ *    load_ms        time taken by sb_load_subset(), median
+ *    mb_per_s       throughput of sb_ctx_feed()
+ *    ns_per_gram    time per quadgram
+ *    p50_ns, etc.   latency percentiles of sb_ctx_detect() for short texts
+ *
+ * With the full set of languages, the stages of classification are also
+ * measured separately, on each input (see run_phase()). Metrics are then named
+ * "<phase>_ns_per_<unit>", where <unit> is a byte, a quadgram, or a call. If
+ * hardware performance counters are available, we also report, for loading
+ * and for each phase, the number of instructions per cycle
+ * ("<phase>_ipc"), and the number of cycles, cache misses, etc., per unit
+ * ("<phase>_<counter>_per_<unit>").
+ *
+ * We include the library source so that the compiler can optimize it along
+ * with the calling code, as it would in most applications, and so that we
+ * can use its UTF-8 decoding functions.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include "../sabir.c"
+#include "../cmd/cmd.h"
+#include "counters.h"
+
+/* Number of times the model is loaded. */
+#define NUM_LOADS 5
+
+/* Number of short texts classified for measuring latency, and their maximum
+ * length.
+ */
+#define NUM_SHORT 5000
+#define MAX_SHORT_LEN 200
+
+/* Size of synthetic inputs. */
+#define SYNTH_LEN (256 * 1024)
+
+static const size_t chunk_sizes[] = {16, 256, 4096, 0};
+
+/* Minimum time to spend on each throughput measurement, in seconds. */
+static double min_time = 0.2;
+
+static struct counters counters;
+static bool have_counters;
+
+struct input {
+   const char *name;
+   uint8_t *text;
+   size_t len;
+   size_t num_grams;
+   uint8_t (*grams)[SB_NGRAM_SIZE];    /* The quadgrams themselves. */
+};
+
+/* Stages of classification. */
+enum phase {
+   PHASE_DECODE,
+   PHASE_HASH,
+   PHASE_SCORE,
+   PHASE_FINISH,
+   PHASE_DETECT,
+   NUM_PHASES,
+};
+
+static const struct {
+   const char *name;
+   const char *unit;
+} phases[NUM_PHASES] = {
+   [PHASE_DECODE] = {"decode", "byte"},
+   [PHASE_HASH] = {"hash", "gram"},
+   [PHASE_SCORE] = {"score", "gram"},
+   [PHASE_FINISH] = {"finish", "call"},
+   [PHASE_DETECT] = {"detect", "byte"},
+};
+
+/* For preventing the compiler from optimizing computations away. */
+static volatile uint32_t sink;
+
+static double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *base_name(const char *path)
+{
+   const char *slash = strrchr(path, '/');
+   return slash ? slash + 1 : path;
+}
+
+static void report(const char *model, size_t labels, const char *input,
+                   size_t chunk, const char *metric, double value)
+{
+   printf("%s\t%zu\t%s\t", model, labels, input);
+   if (chunk)
+      printf("%zu", chunk);
+   else
+      printf("-");
+   printf("\t%s\t%.3f\n", metric, value);
+}
+
+/* Reports hardware counters values for "units" units of work. */
+static void report_counters(const char *model, size_t labels, const char *input,
+                            const char *phase, const char *unit,
+                            const uint64_t vals[static CNT_NUM], double units)
+{
+   char metric[64];
+
+   if (vals[CNT_CYCLES] != UINT64_MAX && vals[CNT_INSTRUCTIONS] != UINT64_MAX && vals[CNT_CYCLES]) {
+      snprintf(metric, sizeof metric, "%s_ipc", phase);
+      report(model, labels, input, 0, metric, (double)vals[CNT_INSTRUCTIONS] / vals[CNT_CYCLES]);
+   }
+   for (int i = 0; i < CNT_NUM; i++) {
+      if (i == CNT_INSTRUCTIONS || vals[i] == UINT64_MAX)
+         continue;
+      snprintf(metric, sizeof metric, "%s_%s_per_%s", phase, counter_names[i], unit);
+      report(model, labels, input, 0, metric, vals[i] / units);
+   }
+}
+
+/* Counts the quadgrams sb_process() extracts from a text. */
+static size_t count_grams(const uint8_t *text, size_t len)
+{
+   size_t num = 0, run = 0;
+   ssize_t clen;
+
+   for (size_t i = 0; i < len; i += clen) {
+      int32_t c;
+      clen = utf8proc_iterate(&text[i], len - i, &c);
+      if (clen <= 0) {
+         clen = 1;
+      } else if (sb_is_letter(c)) {
+         run += clen;
+      } else {
+         num += run > 1 ? run - 1 : 0;
+         run = 0;
+      }
+   }
+   return num + (run > 1 ? run - 1 : 0);
+}
+
+/* Stores the quadgrams sb_process() extracts from a text, in order. */
+static void extract_grams(struct input *in)
+{
+   uint8_t buf[SB_NGRAM_SIZE] = {SB_PAD_CHAR};
+   size_t pos = 1, num = 0;
+   ssize_t clen;
+
+   in->grams = malloc((in->num_grams + 1) * sizeof *in->grams);
+   if (!in->grams)
+      die("out of memory");
+
+   for (size_t i = 0; i <= in->len; i += clen) {
+      int32_t c = 0;
+      clen = i < in->len ? utf8proc_iterate(&in->text[i], in->len - i, &c) : 1;
+      if (clen <= 0) {
+         clen = 1;
+         continue;
+      }
+      bool letter = i < in->len && sb_is_letter(c);
+      for (ssize_t j = 0; j < (letter ? clen : 1); j++) {
+         buf[pos++ % SB_NGRAM_SIZE] = letter ? in->text[i + j] : SB_PAD_CHAR;
+         if (pos < SB_NGRAM_SIZE)
+            continue;
+         for (size_t k = 0; k < SB_NGRAM_SIZE; k++)
+            in->grams[num][k] = buf[(pos + k) % SB_NGRAM_SIZE];
+         num++;
+      }
+      if (!letter) {
+         buf[0] = SB_PAD_CHAR;
+         pos = 1;
+      }
+   }
+   assert(num == in->num_grams);
+}
+
+static void *xmalloc(size_t size)
+{
+   void *mem = malloc(size);
+   if (!mem)
+      die("out of memory");
+   return mem;
+}
+
+static void read_input(struct input *in, const char *path)
+{
+   FILE *fp = fopen(path, "rb");
+   if (!fp)
+      die("cannot open '%s':", path);
+
+   size_t size = 1 << 16;
+   in->text = xmalloc(size);
+   in->len = 0;
+   size_t n;
+   while ((n = fread(&in->text[in->len], 1, size - in->len, fp))) {
+      in->len += n;
+      if (in->len == size) {
+         size *= 2;
+         in->text = realloc(in->text, size);
+         if (!in->text)
+            die("out of memory");
+      }
+   }
+   if (ferror(fp))
+      die("cannot read '%s':", path);
+   fclose(fp);
+   in->name = base_name(path);
+}
+
+/* Simple deterministic generator (xorshift), so that synthetic inputs are the
+ * same from one run to the next.
+ */
+static uint32_t rand_next(uint32_t *state)
+{
+   uint32_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   return *state = x;
+}
+
+/* Random words made of code points drawn from [first, first + range), 2 to 10
+ * code points long, separated with spaces.
+ */
+static void make_words(struct input *in, const char *name, int32_t first,
+                       int32_t range)
+{
+   uint32_t state = 2463534242;
+
+   in->name = name;
+   in->text = xmalloc(SYNTH_LEN + 8);
+   in->len = 0;
+   while (in->len < SYNTH_LEN) {
+      size_t word_len = 2 + rand_next(&state) % 9;
+      for (size_t i = 0; i < word_len && in->len < SYNTH_LEN; i++) {
+         int32_t c = first + rand_next(&state) % range;
+         in->len += utf8proc_encode_char(c, &in->text[in->len]);
+      }
+      in->text[in->len++] = ' ';
+   }
+}
+
+/* Random bytes, mostly invalid UTF-8. */
+static void make_garbage(struct input *in)
+{
+   uint32_t state = 88675123;
+
+   in->name = "synth-invalid";
+   in->text = xmalloc(SYNTH_LEN);
+   in->len = SYNTH_LEN;
+   for (size_t i = 0; i < SYNTH_LEN; i++) {
+      uint32_t r = rand_next(&state);
+      in->text[i] = r & 0x80 ? r >> 8 | 0x80 : 'a' + r % 26;
+   }
+}
+
+static int cmp_doubles(const void *a, const void *b)
+{
+   double x = *(const double *)a, y = *(const double *)b;
+   return (x > y) - (x < y);
+}
+
+static const char *feed(struct sb_ctx *ctx, const struct sabir *sb,
+                        const struct input *in, size_t chunk)
+{
+   if (!chunk)
+      return sb_ctx_detect(ctx, sb, in->text, in->len);
+
+   sb_ctx_init(ctx, sb);
+   for (size_t i = 0; i < in->len; i += chunk)
+      sb_ctx_feed(ctx, &in->text[i], in->len - i < chunk ? in->len - i : chunk);
+   return sb_ctx_finish(ctx);
+}
+
+/* Runs a stage of classification once, and returns the number of units of
+ * work done. The "score" phase includes hashing.
+ */
+static size_t run_phase(enum phase phase, struct sb_ctx *ctx,
+                        const struct sabir *sb, const struct input *in)
+{
+   switch (phase) {
+   case PHASE_DECODE:
+      sink += count_grams(in->text, in->len);
+      return in->len;
+   case PHASE_HASH: {
+      uint32_t acc = 0;
+      for (size_t i = 0; i < in->num_grams; i++) {
+         uint32_t h1 = sb_hash_feature(in->grams[i], 0);
+         for (size_t k = 0; k < ctx->num_active; k++)
+            acc ^= sb_hash_lang(h1, sb->ids[ctx->active[k]]);
+      }
+      sink += acc;
+      return in->num_grams;
+   }
+   case PHASE_SCORE:
+      for (size_t i = 0; i < in->num_grams; i++)
+         sb_update_fine(ctx, in->grams[i], 0, 1);
+      return in->num_grams;
+   case PHASE_FINISH:
+      /* Labels are narrowed by script again on each call, with the letters
+       * counted by bench_phases().
+       */
+      ctx->count_letters = true;
+      sink += *sb_ctx_finish(ctx);
+      return 1;
+   case PHASE_DETECT:
+      sb_ctx_detect(ctx, sb, in->text, in->len);
+      return in->len;
+   default:
+      abort();
+   }
+}
+
+static void bench_phases(const char *model, const struct sabir *sb,
+                         struct sb_ctx *ctx, const struct input *in)
+{
+   size_t labels;
+   sb_langs(sb, &labels);
+
+   for (int p = 0; p < NUM_PHASES; p++) {
+      uint64_t vals[CNT_NUM];
+      size_t units = 0;
+      sb_ctx_init(ctx, sb);
+      if (p == PHASE_FINISH)
+         ctx->num_letters = sb_count_scripts(in->text, in->len, ctx->letters, SB_SCRIPT_LETTERS);
+      counters_start(&counters);
+      double start = now(), elapsed;
+      do {
+         for (int i = 0; i < 100; i++)
+            units += run_phase(p, ctx, sb, in);
+      } while ((elapsed = now() - start) < min_time);
+      counters_stop(&counters, vals);
+      if (!units)
+         continue;
+
+      char metric[64];
+      snprintf(metric, sizeof metric, "%s_ns_per_%s", phases[p].name, phases[p].unit);
+      report(model, labels, in->name, 0, metric, elapsed * 1e9 / units);
+      if (have_counters)
+         report_counters(model, labels, in->name, phases[p].name, phases[p].unit, vals, units);
+   }
+}
+
+static void bench_throughput(const char *model, const struct sabir *sb,
+                             struct sb_ctx *ctx, const struct input *in)
+{
+   size_t labels;
+   sb_langs(sb, &labels);
+
+   for (size_t c = 0; c < sizeof chunk_sizes / sizeof *chunk_sizes; c++) {
+      size_t chunk = chunk_sizes[c];
+      size_t reps = 0;
+      double start = now(), elapsed;
+      do {
+         feed(ctx, sb, in, chunk);
+         reps++;
+      } while ((elapsed = now() - start) < min_time);
+
+      report(model, labels, in->name, chunk, "mb_per_s", reps * in->len / elapsed / 1e6);
+      if (in->num_grams)
+         report(model, labels, in->name, chunk, "ns_per_gram", elapsed * 1e9 / (reps * in->num_grams));
+   }
+}
+
+/* Classifies short slices of all inputs, and reports latency percentiles. */
+static void bench_latency(const char *model, const struct sabir *sb,
+                          struct sb_ctx *ctx, const struct input *ins,
+                          size_t num_ins)
+{
+   static double times[NUM_SHORT];
+   uint32_t state = 521288629;
+   size_t labels;
+   sb_langs(sb, &labels);
+
+   for (size_t i = 0; i < NUM_SHORT; i++) {
+      const struct input *in = &ins[i % num_ins];
+      size_t len = 1 + rand_next(&state) % MAX_SHORT_LEN;
+      if (len > in->len)
+         len = in->len;
+      size_t off = rand_next(&state) % (in->len - len + 1);
+      double start = now();
+      sb_ctx_detect(ctx, sb, &in->text[off], len);
+      times[i] = (now() - start) * 1e9;
+   }
+   qsort(times, NUM_SHORT, sizeof *times, cmp_doubles);
+   report(model, labels, "short", 0, "p50_ns", times[NUM_SHORT / 2]);
+   report(model, labels, "short", 0, "p90_ns", times[NUM_SHORT * 9 / 10]);
+   report(model, labels, "short", 0, "p99_ns", times[NUM_SHORT * 99 / 100]);
+   report(model, labels, "short", 0, "max_ns", times[NUM_SHORT - 1]);
+}
+
+/* Loads the "num_langs" first languages of the model several times, and
+ * returns the last loaded instance.
+ */
+static struct sabir *bench_load(const char *path, const char *const *langs,
+                                size_t num_langs)
+{
+   const char *subset[SB_MAX_LABELS + 1];
+   double times[NUM_LOADS];
+   uint64_t vals[CNT_NUM], totals[CNT_NUM] = {0};
+   struct sabir *sb = NULL;
+
+   memcpy(subset, langs, num_langs * sizeof *langs);
+   subset[num_langs] = NULL;
+   for (size_t i = 0; i < NUM_LOADS; i++) {
+      sb_dealloc(sb);
+      counters_start(&counters);
+      double start = now();
+      int ret = sb_load_subset(&sb, path, subset);
+      times[i] = (now() - start) * 1e3;
+      counters_stop(&counters, vals);
+      if (ret)
+         die("cannot load model from '%s': %s", path, sb_strerror(ret));
+      for (int j = 0; j < CNT_NUM; j++)
+         totals[j] = vals[j] == UINT64_MAX ? UINT64_MAX : totals[j] + vals[j];
+   }
+   qsort(times, NUM_LOADS, sizeof *times, cmp_doubles);
+   report(base_name(path), num_langs, "-", 0, "load_ms", times[NUM_LOADS / 2]);
+   if (have_counters)
+      report_counters(base_name(path), num_langs, "-", "load", "load", totals, NUM_LOADS);
+   return sb;
+}
+
+static void bench_model(const char *path, struct input *ins, size_t num_ins)
+{
+   struct sabir *all;
+   int ret = sb_load(&all, path);
+   if (ret)
+      die("cannot load model from '%s': %s", path, sb_strerror(ret));
+   size_t num_labels;
+   const char *const *langs = sb_langs(all, &num_labels);
+
+   struct sb_ctx *ctx;
+   if (sb_ctx_new(&ctx))
+      die("out of memory");
+
+   /* Powers of two, and the full set of languages. */
+   for (size_t n = 1; ; n = n * 2 < num_labels ? n * 2 : num_labels) {
+      struct sabir *sb = bench_load(path, langs, n);
+      for (size_t i = 0; i < num_ins; i++)
+         bench_throughput(base_name(path), sb, ctx, &ins[i]);
+      bench_latency(base_name(path), sb, ctx, ins, num_ins);
+      if (n == num_labels)
+         for (size_t i = 0; i < num_ins; i++)
+            bench_phases(base_name(path), sb, ctx, &ins[i]);
+      sb_dealloc(sb);
+      if (n == num_labels)
+         break;
+   }
+
+   sb_ctx_dealloc(ctx);
+   sb_dealloc(all);
+}
+
+int main(int argc, char **argv)
+{
+   const char *models = NULL;
+   struct option opts[] = {
+      {'m', "models", OPT_STR(models)},
+      {'t', "time", OPT_DOUBLE(min_time)},
+      {0},
+   };
+   const char help[] =
+      #include "bench.ih"
+   ;
+
+   parse_options(opts, help, &argc, &argv);
+   if (!models)
+      die("no model given");
+
+   size_t num_ins = argc + 3;
+   struct input *ins = xmalloc(num_ins * sizeof *ins);
+   for (int i = 0; i < argc; i++)
+      read_input(&ins[i], argv[i]);
+   make_words(&ins[argc], "synth-ascii", 'a', 26);
+   make_words(&ins[argc + 1], "synth-cyrillic", 0x430, 32);
+   make_garbage(&ins[argc + 2]);
+   for (size_t i = 0; i < num_ins; i++) {
+      ins[i].num_grams = count_grams(ins[i].text, ins[i].len);
+      extract_grams(&ins[i]);
+   }
+
+   have_counters = counters_open(&counters);
+   if (!have_counters)
+      complain("hardware performance counters are not available; reporting timings only");
+
+   printf("# model\tlabels\tinput\tchunk\tmetric\tvalue\n");
+   char *list = xmalloc(strlen(models) + 1);
+   strcpy(list, models);
+   for (char *model = strtok(list, ","); model; model = strtok(NULL, ","))
+      bench_model(model, ins, num_ins);
+
+   counters_close(&counters);
+   for (size_t i = 0; i < num_ins; i++) {
+      free(ins[i].text);
+      free(ins[i].grams);
+   }
+   free(ins);
+   free(list);
+   return EXIT_SUCCESS;
+}
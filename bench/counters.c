@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "counters.h"
+
+const char *const counter_names[CNT_NUM] = {
+   [CNT_CYCLES] = "cycles",
+   [CNT_INSTRUCTIONS] = "instructions",
+   [CNT_CACHE_MISSES] = "cache_misses",
+   [CNT_DTLB_MISSES] = "dtlb_misses",
+   [CNT_BRANCH_MISSES] = "branch_misses",
+};
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const struct {
+   uint32_t type;
+   uint64_t config;
+} events[CNT_NUM] = {
+   [CNT_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+   [CNT_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+   [CNT_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+   [CNT_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+                                         | PERF_COUNT_HW_CACHE_OP_READ << 8
+                                         | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+   [CNT_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+bool counters_open(struct counters *cnt)
+{
+   bool any = false;
+
+   for (int i = 0; i < CNT_NUM; i++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof attr);
+      attr.size = sizeof attr;
+      attr.type = events[i].type;
+      attr.config = events[i].config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      cnt->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      any |= cnt->fds[i] >= 0;
+   }
+   return any;
+}
+
+void counters_close(struct counters *cnt)
+{
+   for (int i = 0; i < CNT_NUM; i++)
+      if (cnt->fds[i] >= 0)
+         close(cnt->fds[i]);
+}
+
+void counters_start(struct counters *cnt)
+{
+   for (int i = 0; i < CNT_NUM; i++) {
+      if (cnt->fds[i] >= 0) {
+         ioctl(cnt->fds[i], PERF_EVENT_IOC_RESET, 0);
+         ioctl(cnt->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+   }
+}
+
+void counters_stop(struct counters *cnt, uint64_t vals[static CNT_NUM])
+{
+   for (int i = 0; i < CNT_NUM; i++)
+      if (cnt->fds[i] >= 0)
+         ioctl(cnt->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+   for (int i = 0; i < CNT_NUM; i++) {
+      uint64_t val;
+      if (cnt->fds[i] < 0 || read(cnt->fds[i], &val, sizeof val) != sizeof val)
+         val = UINT64_MAX;
+      vals[i] = val;
+   }
+}
+
+#else
+
+bool counters_open(struct counters *cnt)
+{
+   for (int i = 0; i < CNT_NUM; i++)
+      cnt->fds[i] = -1;
+   return false;
+}
+
+void counters_close(struct counters *cnt)
+{
+   (void)cnt;
+}
+
+void counters_start(struct counters *cnt)
+{
+   (void)cnt;
+}
+
+void counters_stop(struct counters *cnt, uint64_t vals[static CNT_NUM])
+{
+   (void)cnt;
+   for (int i = 0; i < CNT_NUM; i++)
+      vals[i] = UINT64_MAX;
+}
+
+#endif
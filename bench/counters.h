@@ -0,0 +1,40 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+/* Hardware performance counters, through perf_event_open(2). Only available
+ * on Linux, and only if the kernel lets us use them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+   CNT_CYCLES,
+   CNT_INSTRUCTIONS,
+   CNT_CACHE_MISSES,
+   CNT_DTLB_MISSES,
+   CNT_BRANCH_MISSES,
+   CNT_NUM
+};
+
+/* Short names of the above counters. */
+extern const char *const counter_names[CNT_NUM];
+
+struct counters {
+   int fds[CNT_NUM];    /* -1 if the counter is unavailable. */
+};
+
+/* Opens counters for the calling thread. Returns false if none of them is
+ * available, in which case the functions below do nothing.
+ */
+bool counters_open(struct counters *);
+void counters_close(struct counters *);
+
+void counters_start(struct counters *);
+
+/* Stops counting, and fills "vals" with the counts since the last call to
+ * counters_start(). Unavailable counters are set to UINT64_MAX.
+ */
+void counters_stop(struct counters *, uint64_t vals[static CNT_NUM]);
+
+#endif
@@ -0,0 +1,14 @@
+#!/usr/bin/env sh
+# Benchmarks the default model, and models of various sizes and layouts trained
+# on the test data. Arguments are passed to the benchmark program, e.g.:
+#    bench/run.sh --time=1 > before.tsv
+
+set -e
+cd "$(dirname "$0")/.."
+
+./sabir-train dump test/data/* > bench/trained.tmp
+./sabir-train dump --buckets=16384 test/data/* > bench/small.tmp
+./sabir-train dump --layout=sparse test/data/* > bench/sparse.tmp
+
+bench/bench -m model.sb,bench/trained.tmp,bench/small.tmp,bench/sparse.tmp "$@" test/data/*
+rm bench/*.tmp
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include "../sabir.h"
 #include "cmd.h"
 
@@ -15,6 +16,45 @@ noreturn static void version(void)
    exit(EXIT_SUCCESS);
 }
 
+static void report(void *arg, const unsigned char *gram, const char *lang,
+                   uint32_t hash, double score)
+{
+   (void)arg;
+   for (size_t i = 0; i < 4; i++)
+      printf("%02x", gram[i]);
+   printf(" %s %"PRIu32" %la\n", lang, hash, score);
+}
+
+/* Totals, for --stats. */
+static struct sb_stats totals;
+
+static void add_stats(const struct sabir *sb)
+{
+   struct sb_stats st;
+   sb_stats(sb, &st);
+
+   totals.bytes += st.bytes;
+   totals.code_points += st.code_points;
+   totals.letters += st.letters;
+   totals.invalid += st.invalid;
+   totals.truncated += st.truncated;
+   totals.grams += st.grams;
+   totals.skipped += st.skipped;
+   totals.probes += st.probes;
+}
+
+static void display_stats(void)
+{
+   fprintf(stderr, "bytes: %zu\n", totals.bytes);
+   fprintf(stderr, "code points: %zu\n", totals.code_points);
+   fprintf(stderr, "letters: %zu\n", totals.letters);
+   fprintf(stderr, "invalid UTF-8 sequences: %zu\n", totals.invalid);
+   fprintf(stderr, "truncated UTF-8 sequences: %zu\n", totals.truncated);
+   fprintf(stderr, "quadgrams: %zu\n", totals.grams);
+   fprintf(stderr, "skipped lookups: %zu\n", totals.skipped);
+   fprintf(stderr, "table probes: %zu\n", totals.probes);
+}
+
 static const char *detect(struct sabir *sb, const char *path, size_t buf_size)
 {
    FILE *fp = path ? fopen(path, "r") : stdin;
@@ -34,6 +74,7 @@ static const char *detect(struct sabir *sb, const char *path, size_t buf_size)
       complain("cannot read '%s':", path);
    else
       lang = sb_finish(sb);
+   add_stats(sb);
 
    if (path)  
       fclose(fp);
@@ -74,6 +115,23 @@ static int display_langs(struct sabir *sb)
    return EXIT_SUCCESS;
 }
 
+static const char **split_langs(char *list)
+{
+   size_t nr = 1;
+   for (const char *p = list; *p; p++)
+      nr += *p == ',';
+
+   const char **langs = malloc((nr + 1) * sizeof *langs);
+   if (!langs)
+      die("out of memory");
+
+   nr = 0;
+   for (char *lang = strtok(list, ","); lang; lang = strtok(NULL, ","))
+      langs[nr++] = lang;
+   langs[nr] = NULL;
+   return langs;
+}
+
 /* We do that for testing. */
 static size_t get_buf_size(void)
 {
@@ -89,11 +147,17 @@ int main(int argc, char **argv)
 {
    const char *model = SB_PREFIX"/share/sabir/model.sb";
    bool list = false;
-   extern bool sb_verbose;
+   const char *langs = NULL;
+   bool dedup = false;
+   bool verbose = false;
+   bool stats = false;
    struct option opts[] = {
       {'m', "model", OPT_STR(model)},
       {'l', "list", OPT_BOOL(list)},
-      {'v', "verbose", OPT_BOOL(sb_verbose)},
+      {'r', "restrict", OPT_STR(langs)},
+      {'d', "dedup", OPT_BOOL(dedup)},
+      {'v', "verbose", OPT_BOOL(verbose)},
+      {'s', "stats", OPT_BOOL(stats)},
       {'\0', "version", OPT_FUNC(version)},
       {0},
    };
@@ -103,18 +167,27 @@ int main(int argc, char **argv)
 
    parse_options(opts, help, &argc, &argv);
 
+   const char **subset = langs ? split_langs((char *)langs) : NULL;
+
    struct sabir *sb;
-   int ret = sb_load(&sb, model);
+   int ret = sb_load_subset(&sb, model, subset);
    if (ret)
       die("cannot load model from '%s': %s", model, sb_strerror(ret));
 
+   sb_set_dedup(sb, dedup);
+   if (verbose)
+      sb_set_trace(sb, report, NULL);
+
    if (list)
       ret = display_langs(sb);
    else if (argc <= 1)
       ret = process_one(sb, *argv, get_buf_size());
    else
       ret = process_many(sb, argc, argv, get_buf_size());
+   if (stats && !list)
+      display_stats();
    
    sb_dealloc(sb);
+   free(subset);
    return ret;
 }
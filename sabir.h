@@ -8,6 +8,7 @@
 #define SB_VERSION "0.3"
 
 #include <stddef.h>
+#include <stdint.h>
 
 enum {
    SB_OK,      /* No error. */
@@ -16,6 +17,7 @@ enum {
    SB_EMODEL,  /* Invalid model file. */
    SB_EIO,     /* I/O error. */
    SB_ENOMEM,  /* Out of memory. */
+   SB_ENOLANG, /* None of the requested languages is in the model. */
 };
 
 /* Returns a string describing an error code. */
@@ -30,6 +32,17 @@ struct sabir;
  */
 int sb_load(struct sabir **, const char *path);
 
+/* Like sb_load(), but only loads the given languages.
+ * "langs" is a NULL-terminated array of language names. Names that are not
+ * supported by the model are ignored. If none of them is, returns SB_ENOLANG.
+ * With models created by recent versions of sabir-train, the features table is
+ * shrunk in proportion to the number of features of the loaded languages, so
+ * both memory usage and classification time are reduced. This entails more
+ * hashing collisions, so results might differ slightly from those obtained
+ * with sb_restrict(). With older models, the whole table is loaded.
+ */
+int sb_load_subset(struct sabir **, const char *path, const char *const *langs);
+
 /* Deallocates a model. */
 void sb_dealloc(struct sabir *);
 
@@ -39,7 +52,7 @@ void sb_dealloc(struct sabir *);
  * deallocated. If "nr" is not NULL, fills it with the number of supported
  * languages.
  */
-const char *const *sb_langs(struct sabir *, size_t *nr);
+const char *const *sb_langs(const struct sabir *, size_t *nr);
 
 /* Detects the language of a UTF-8 string.
  * The returned pointer points to this object's internals. It should then not
@@ -62,4 +75,224 @@ void sb_init(struct sabir *);
 void sb_feed(struct sabir *, const void *chunk, size_t len);
 const char *sb_finish(struct sabir *);
 
+/* Can be called instead of sb_feed() to give the classifier quadgrams rather
+ * than text. "grams" must hold "num" quadgrams of 4 bytes each, as extracted
+ * from text (see the README file). This is meant for evaluating models on
+ * documents that are already split into quadgrams, as sabir-train does. Since
+ * there is no text to look at, languages are not filtered by script. Quadgrams
+ * made of four zero bytes, which text can't give, are skipped. Calls to this
+ * function and to sb_feed() must not be mixed.
+ */
+void sb_feed_grams(struct sabir *, const void *grams, size_t num);
+
+/* Restricts classification to a subset of the languages supported by a model.
+ * This must be called after sb_init() and before sb_feed(); the restriction is
+ * lifted by the next call to sb_init(). Only the retained languages are scored,
+ * so classification gets faster as the subset gets smaller.
+ * "langs" is a NULL-terminated array of language names. Names that are not
+ * supported by the model are ignored. Returns the number of languages retained.
+ * If none of the given languages is supported, the classifier state is left
+ * unchanged and zero is returned. Successive calls narrow the subset further.
+ */
+size_t sb_restrict(struct sabir *, const char *const *langs);
+
+/* Classification contexts.
+ * The above functions use a classification state embedded in the model, and
+ * are thus not reentrant. To classify several texts concurrently with the
+ * same model, use one context per thread. A context is not tied to a specific
+ * model: it is bound to one each time sb_ctx_init() or sb_ctx_detect() is
+ * called, and remains so until the corresponding call to sb_ctx_finish(). The
+ * functions below work like their counterparts above.
+ */
+struct sb_ctx;
+
+/* Allocates a context. Returns SB_OK or SB_ENOMEM. */
+int sb_ctx_new(struct sb_ctx **);
+void sb_ctx_dealloc(struct sb_ctx *);
+
+const char *sb_ctx_detect(struct sb_ctx *, const struct sabir *,
+                          const void *text, size_t len);
+void sb_ctx_init(struct sb_ctx *, const struct sabir *);
+void sb_ctx_feed(struct sb_ctx *, const void *chunk, size_t len);
+void sb_ctx_feed_grams(struct sb_ctx *, const void *grams, size_t num);
+const char *sb_ctx_finish(struct sb_ctx *);
+size_t sb_ctx_restrict(struct sb_ctx *, const char *const *langs);
+
+/* Enables (if "enable" is non-zero) or disables deduplication mode.
+ * In this mode, the quadgrams of each chunk of text are counted first, and
+ * each distinct quadgram is then scored once. This is faster with long texts,
+ * which contain many repeated quadgrams, but results can differ slightly from
+ * those of the normal mode, because floating-point additions are performed in
+ * a different order. This setting persists across classifications. It is
+ * disabled by default.
+ */
+void sb_ctx_set_dedup(struct sb_ctx *, int enable);
+void sb_set_dedup(struct sabir *, int enable);
+
+/* Statistics about the last (or current) classification performed with a
+ * context, for finding out why some texts take longer to classify than others.
+ * They are only gathered if the library is compiled with SB_STATS defined.
+ * Otherwise, all counters are zero.
+ */
+struct sb_stats {
+   size_t bytes;        /* Bytes fed. */
+   size_t code_points;  /* Code points decoded. */
+   size_t letters;      /* Code points that are letters. */
+   size_t invalid;      /* Invalid UTF-8 sequences. */
+   size_t truncated;    /* UTF-8 sequences split between two chunks. */
+   size_t grams;        /* Quadgrams scored. */
+   size_t skipped;      /* Per-language lookups skipped by filters. */
+   size_t probes;       /* Model table entries looked up. */
+};
+
+void sb_ctx_stats(const struct sb_ctx *, struct sb_stats *);
+void sb_stats(const struct sabir *, struct sb_stats *);
+
+/* Tracing, for debugging and testing.
+ * If the library is compiled with SB_DEBUG defined, the trace function of a
+ * context, if any, is called each time a quadgram is scored for a language,
+ * with the following arguments:
+ *    arg: the pointer given to sb_ctx_set_trace()
+ *    gram: the quadgram (4 bytes, not null-terminated)
+ *    lang: the language
+ *    hash: the hash value used for looking up the quadgram
+ *    score: its score for this language
+ * The scores of clusters of hierarchical models are not reported. If SB_DEBUG is
+ * not defined, this is a no-op. Pass a NULL function to disable tracing. This setting
+ * persists across classifications.
+ */
+typedef void sb_trace_fn(void *arg, const unsigned char *gram, const char *lang,
+                         uint32_t hash, double score);
+
+void sb_ctx_set_trace(struct sb_ctx *, sb_trace_fn *, void *arg);
+void sb_set_trace(struct sabir *, sb_trace_fn *, void *arg);
+
+/* Hot-swappable models, for long-running processes.
+ * A live handle holds a model that can be replaced with a new one while other
+ * threads are using it. Readers must bracket each classification with
+ * sb_live_acquire() and sb_live_release(), and must classify through their own
+ * context. The strings returned by sb_ctx_finish() and sb_langs() remain valid
+ * until the model is released. Readers never block. A model that has been
+ * replaced is deallocated when the last reader holding it releases it.
+ * Example:
+ *
+ *    const struct sabir *sb = sb_live_acquire(live);
+ *    const char *lang = sb_ctx_detect(ctx, sb, text, len);
+ *    ...
+ *    sb_live_release(sb);
+ */
+struct sb_live;
+
+/* Allocates a live handle and publishes the given model through it.
+ * The handle takes ownership of the model, which must not be passed to
+ * sb_dealloc() afterwards. Returns SB_OK or SB_ENOMEM. In the latter case, the
+ * model is still owned by the caller.
+ */
+int sb_live_new(struct sb_live **, struct sabir *);
+
+/* Deallocates a live handle and releases its current model.
+ * No reader should be using the handle at this point, but models still
+ * acquired by readers remain valid until they are released.
+ */
+void sb_live_dealloc(struct sb_live *);
+
+/* Atomically replaces the model of a live handle.
+ * The handle takes ownership of the new model. This might wait for readers
+ * that are in the middle of sb_live_acquire(), but not for readers that are
+ * classifying texts with the old model. Concurrent calls are serialized.
+ */
+void sb_live_publish(struct sb_live *, struct sabir *);
+
+/* Returns the current model of a live handle, and prevents it from being
+ * deallocated until it is passed to sb_live_release().
+ * The returned model must not be used with sb_init(), sb_feed(), sb_finish(),
+ * or sb_detect().
+ */
+const struct sabir *sb_live_acquire(struct sb_live *);
+void sb_live_release(const struct sabir *);
+
+/* Result caches, for applications that classify the same texts over and over.
+ * A cache maps texts to their language, as found by sb_ctx_detect(). Texts are
+ * identified by a 64-bit hash of their contents, so collisions are possible,
+ * but very unlikely. A cache can be shared between threads and between models;
+ * the classification context must be specific to the calling thread, though.
+ * When full, the least recently used entries are evicted.
+ */
+struct sb_cache;
+
+/* Allocates a cache that can hold (at least) "capacity" results.
+ * Returns SB_OK or SB_ENOMEM.
+ */
+int sb_cache_new(struct sb_cache **, size_t capacity);
+void sb_cache_dealloc(struct sb_cache *);
+
+/* Like sb_ctx_detect(), but returns a cached result if possible. */
+const char *sb_cache_detect(struct sb_cache *, struct sb_ctx *,
+                            const struct sabir *,
+                            const void *text, size_t len);
+
+/* Returns the number of lookups that have been satisfied from the cache,
+ * and the number of those that have not, since the cache was created. Either
+ * pointer can be NULL.
+ */
+void sb_cache_stats(struct sb_cache *, size_t *hits, size_t *misses);
+
+/* Training.
+ * A trainer counts the quadgrams of texts written in known languages, and
+ * writes the corresponding model, in the format read by sb_load(). Quadgrams
+ * are extracted exactly as when classifying. Since models store raw counts, a
+ * trainer can also start from an existing model, and add new texts to it,
+ * possibly in new languages.
+ * Compared to sabir-train, texts are not Unicode-normalized, and the amount
+ * of text per language is not equalized, so the caller should feed similar
+ * amounts of text for each language. Hierarchical models are not supported.
+ */
+struct sb_trainer;
+
+/* Allocates a trainer for a new model.
+ * If "sparse" is non-zero, the model uses the sparse layout (see
+ * "sabir-train --help"). "buckets" is the size of its features table, which is
+ * rounded up to a power of two, or zero to pick one from the number of
+ * features. Returns SB_OK or SB_ENOMEM.
+ */
+int sb_trainer_new(struct sb_trainer **, int sparse, size_t buckets);
+
+/* Allocates a trainer that starts from the counts of a model file.
+ * The new model will have the same layout and table size. Returns SB_OK or an
+ * error code, as sb_load() does.
+ */
+int sb_trainer_load(struct sb_trainer **, const char *path);
+
+void sb_trainer_dealloc(struct sb_trainer *);
+
+/* Counts the quadgrams of a UTF-8 text written in a given language.
+ * Each call is treated as a separate text. Unknown languages are added to the
+ * model, except with models in the old (version 1) format. Returns SB_OK,
+ * SB_ENOLANG if the language cannot be added, or SB_ENOMEM. In the latter
+ * case, some quadgrams might have been lost, and the trainer should not be
+ * used further.
+ */
+int sb_trainer_feed(struct sb_trainer *, const char *lang,
+                    const void *text, size_t len);
+
+/* Reduces the size of the features table of the model being built.
+ * "buckets" is rounded up to a power of two. If it is not smaller than the
+ * current size, this does nothing. Buckets are folded onto each other, which
+ * gives the same model as training with the smaller size from the start: a
+ * trainer loaded from a model can thus shrink it without the training corpus.
+ * For new models whose size is yet to be determined, this sets it.
+ */
+void sb_trainer_fold(struct sb_trainer *, size_t buckets);
+
+/* Returns the size of the features table of the model being built, or zero if
+ * it is yet to be determined.
+ */
+size_t sb_trainer_buckets(const struct sb_trainer *);
+
+/* Writes the current model to a file. The trainer can still be fed
+ * afterwards. Returns SB_OK, SB_ENOLANG if no text has been fed yet, SB_EOPEN,
+ * SB_EIO, or SB_ENOMEM.
+ */
+int sb_trainer_dump(const struct sb_trainer *, const char *path);
+
 #endif
@@ -3,33 +3,179 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdalign.h>
+#include <assert.h>
 #include <math.h>
 #include <float.h>
 #include <inttypes.h>
+#include <stdatomic.h>
+#include <threads.h>
 
 #include "lib/utf8proc.h"
 #include "api.h"
+#include "script.h"
 
 #ifdef SB_DEBUG
 static const bool sb_debug = true;
 #else
 static const bool sb_debug = false;
 #endif
-bool sb_verbose;
+
+#ifdef SB_STATS
+static const bool sb_counting = true;
+#else
+static const bool sb_counting = false;
+#endif
+
+/* Scores are logarithms of counts. By default, they are stored as
+ * floating-point numbers. If SB_FIXED_POINT is defined, they are instead
+ * stored as fixed-point numbers with SB_FIXED_SCALE as scale factor, and
+ * summed as integers. This is faster, and the result of a sum then doesn't
+ * depend on the order of its terms.
+ */
+#ifdef SB_FIXED_POINT
+typedef uint32_t sb_score;
+typedef uint64_t sb_prob;
+#define SB_FIXED_SCALE 65536
+#else
+typedef double sb_score;
+typedef double sb_prob;
+#endif
 
 #define SB_NGRAM_SIZE 4
 #define SB_PAD_CHAR 0xff
 
-struct sabir {
-   size_t num_labels;
-   size_t table_mask;
-   const char *const *labels;
-   double *probs;
+#define SB_MAX_LABELS 255
+#define SB_MAX_LABELS_LEN 2048
+#define SB_MAX_FEATURES ((size_t)1 << 28)
+
+/* A script is deemed to be present in a text if it accounts for at least
+ * 1/SB_SCRIPT_SHARE of its first SB_SCRIPT_LETTERS letters. See
+ * sb_narrow_scripts().
+ */
+#define SB_SCRIPT_SHARE 10
+#define SB_SCRIPT_LETTERS 256
+
+static_assert(SB_NUM_SCRIPTS <= 32, "scripts don't fit in a bit mask");
+
+/* With hierarchical models, number of quadgrams to score at the cluster level
+ * before choosing a cluster. See sb_update_coarse().
+ */
+#define SB_COARSE_GRAMS 1024
+
+/* Maximum number of quadgrams in the hot quadgrams cache, and maximum size in
+ * bytes of their scores, so that the cache stays small whatever the number of
+ * labels. See sb_read_hot().
+ */
+#define SB_MAX_HOT 65536
+#define SB_HOT_BYTES (1 << 20)
+
+static_assert(SB_NGRAM_SIZE == sizeof(uint32_t), "quadgrams don't fit in a key");
+
+/* Size of the quadgrams deduplication table, and maximum number of distinct
+ * quadgrams it can hold before it is flushed. See sb_dedup().
+ */
+#define SB_DEDUP_SLOTS 4096
+#define SB_DEDUP_MAX (SB_DEDUP_SLOTS / 2)
+
+struct sb_trainer;
+
+struct sb_ctx {
+   const struct sabir *sb;          /* Model in use. */
+   struct sb_trainer *trainer;      /* Or trainer fed, see sb_trainer_feed(). */
    uint8_t buf[SB_NGRAM_SIZE];      /* Current quadgram (rolling buffer). */
    size_t buf_pos;                  /* Current write pos in this buffer. */
    uint8_t pending[SB_NGRAM_SIZE];
    ssize_t pending_have;
-   double model[];
+   bool started;                    /* Whether we've been fed some text. */
+   sb_trace_fn *trace;              /* See sb_ctx_set_trace(). */
+   void *trace_arg;
+   struct sb_stats stats;           /* Only updated if SB_STATS is defined. */
+   bool count_letters;              /* Whether to fill "letters". */
+   size_t num_letters;              /* Letters seen so far. */
+   size_t letters[SB_NUM_SCRIPTS];  /* Same thing, per script. */
+   size_t num_active;               /* Number of labels to score. */
+   uint8_t active[SB_MAX_LABELS];   /* Their indexes, in increasing order. */
+   bool is_active[SB_MAX_LABELS];   /* Same thing, indexed by label. */
+   sb_prob probs[SB_MAX_LABELS];
+
+   /* For hierarchical models. */
+   bool coarse_phase;               /* Whether a cluster is yet to be chosen. */
+   size_t num_active_clusters;
+   uint8_t active_clusters[SB_MAX_LABELS];
+   sb_prob cluster_probs[SB_MAX_LABELS];
+   size_t num_grams;                /* Quadgrams seen during coarse phase. */
+   uint8_t grams[SB_COARSE_GRAMS][SB_NGRAM_SIZE];
+
+   /* For deduplicating quadgrams. Slots are empty if their key is zero. */
+   bool dedup;                      /* Whether enabled. */
+   size_t num_dedup;                /* Number of occupied slots. */
+   uint16_t dedup_used[SB_DEDUP_MAX];        /* Their indexes. */
+   struct {
+      uint32_t key;
+      uint32_t count;
+   } dedup_slots[SB_DEDUP_SLOTS];
+};
+
+struct sabir {
+   size_t num_labels;
+   size_t table_mask;
+   const char *const *labels;
+   uint8_t ids[SB_MAX_LABELS];      /* Label identifiers, for hashing. */
+   /* Sparse layout. Posting list of bucket "i" is at [post_offs[i],
+    * post_offs[i + 1]). If "post_offs" is NULL, we use the hashed layout,
+    * and the features table is "model".
+    */
+   uint32_t *post_offs;
+   uint8_t *post_labels;
+   sb_score *post_scores;
+   bool has_scripts;                /* Whether "scripts" is meaningful. */
+   uint32_t scripts[SB_MAX_LABELS]; /* Scripts of each label (bit masks). */
+   size_t num_clusters;             /* Zero if the model isn't hierarchical. */
+   uint8_t clusters[SB_MAX_LABELS]; /* Cluster of each label. */
+   size_t coarse_mask;
+   sb_score *coarse;                /* Cluster-level features. */
+   /* Hot quadgrams cache, or NULL. Slot "i" holds quadgram "hot_keys[i]" (zero
+    * if the slot is empty), and its score for each label, at
+    * "hot_scores[i * num_labels]".
+    */
+   unsigned hot_shift;
+   uint32_t *hot_keys;
+   sb_score *hot_scores;
+   atomic_size_t refs;              /* See sb_live_acquire(). */
+   uint64_t serial;                 /* Unique model identifier. */
+   struct sb_ctx ctx;               /* For sb_init(), sb_feed(), etc. */
+   sb_score model[];
+};
+
+/* Number of entries per set of a result cache. */
+#define SB_CACHE_WAYS 4
+
+struct sb_cache_set {
+   mtx_t lock;
+   uint32_t clock;                  /* For LRU replacement. */
+   struct {
+      uint64_t hash;                /* Hash of the text. */
+      uint64_t serial;              /* Model serial, or zero if empty. */
+      uint32_t stamp;               /* Value of "clock" when last used. */
+      uint8_t label;                /* Result. */
+   } ways[SB_CACHE_WAYS];
+};
+
+struct sb_cache {
+   size_t set_mask;
+   atomic_size_t hits;
+   atomic_size_t misses;
+   struct sb_cache_set sets[];
+};
+
+/* Last serial number assigned to a model. */
+static atomic_uint_fast64_t sb_serial;
+
+struct sb_live {
+   _Atomic(struct sabir *) current;
+   atomic_uint epoch;
+   atomic_size_t pins[2];           /* Readers, per epoch parity. */
+   atomic_flag publishing;
 };
 
 const char *sb_strerror(int err)
@@ -41,6 +187,7 @@ const char *sb_strerror(int err)
       [SB_EMODEL] = "invalid model file",
       [SB_EIO] = "I/O error",
       [SB_ENOMEM] = "out of memory",
+      [SB_ENOLANG] = "no such language in model",
    };
 
    if (err >= 0 && (size_t)err < sizeof tbl / sizeof *tbl)
@@ -48,13 +195,125 @@ const char *sb_strerror(int err)
    return "unknown error";
 }
 
+void sb_ctx_init(struct sb_ctx *ctx, const struct sabir *sb)
+{
+   ctx->sb = sb;
+   ctx->buf[0] = SB_PAD_CHAR;
+   ctx->buf_pos = 1;
+   for (size_t i = 0; i < sb->num_labels; i++) {
+      ctx->active[i] = i;
+      ctx->is_active[i] = true;
+      ctx->probs[i] = 0;
+   }
+   ctx->num_active = sb->num_labels;
+   ctx->pending_have = 0;
+   ctx->started = false;
+   ctx->count_letters = sb->has_scripts;
+   ctx->num_letters = 0;
+   memset(ctx->letters, 0, sizeof ctx->letters);
+   ctx->coarse_phase = false;
+   ctx->stats = (struct sb_stats){0};
+
+   /* In case the previous classification wasn't finished. */
+   for (size_t i = 0; i < ctx->num_dedup; i++)
+      ctx->dedup_slots[ctx->dedup_used[i]].key = 0;
+   ctx->num_dedup = 0;
+}
+
 void sb_init(struct sabir *sb)
 {
-   sb->buf[0] = SB_PAD_CHAR;
-   sb->buf_pos = 1;
-   for (size_t i = 0; i < sb->num_labels; i++)
-      sb->probs[i] = 0.;
-   sb->pending_have = 0;
+   sb_ctx_init(&sb->ctx, sb);
+}
+
+/* Only retains the labels to score for which "wanted" is true. If there is no
+ * such label, leaves the set of labels to score unchanged. Returns the number
+ * of labels retained.
+ */
+static size_t sb_narrow(struct sb_ctx *ctx, const bool wanted[static SB_MAX_LABELS])
+{
+   size_t nr = 0;
+   for (size_t k = 0; k < ctx->num_active; k++)
+      nr += wanted[ctx->active[k]];
+   if (!nr)
+      return 0;
+
+   size_t j = 0;
+   for (size_t k = 0; k < ctx->num_active; k++) {
+      size_t i = ctx->active[k];
+      if (wanted[i])
+         ctx->active[j++] = i;
+      else
+         ctx->is_active[i] = false;
+   }
+   ctx->num_active = j;
+   return nr;
+}
+
+size_t sb_ctx_restrict(struct sb_ctx *ctx, const char *const *langs)
+{
+   const struct sabir *sb = ctx->sb;
+   bool wanted[SB_MAX_LABELS] = {false};
+
+   for ( ; *langs; langs++)
+      for (size_t i = 0; i < sb->num_labels; i++)
+         if (!strcmp(*langs, sb->labels[i]))
+            wanted[i] = true;
+
+   return sb_narrow(ctx, wanted);
+}
+
+size_t sb_restrict(struct sabir *sb, const char *const *langs)
+{
+   return sb_ctx_restrict(&sb->ctx, langs);
+}
+
+int sb_ctx_new(struct sb_ctx **ctxp)
+{
+   *ctxp = calloc(1, sizeof **ctxp);
+   return *ctxp ? SB_OK : SB_ENOMEM;
+}
+
+void sb_ctx_set_dedup(struct sb_ctx *ctx, int enable)
+{
+   ctx->dedup = enable;
+}
+
+void sb_set_dedup(struct sabir *sb, int enable)
+{
+   sb_ctx_set_dedup(&sb->ctx, enable);
+}
+
+void sb_ctx_stats(const struct sb_ctx *ctx, struct sb_stats *stats)
+{
+   *stats = ctx->stats;
+}
+
+void sb_stats(const struct sabir *sb, struct sb_stats *stats)
+{
+   sb_ctx_stats(&sb->ctx, stats);
+}
+
+/* Increments a statistics counter, if statistics are enabled. */
+static void sb_count(size_t *counter, size_t n)
+{
+   if (sb_counting)
+      *counter += n;
+}
+
+void sb_ctx_set_trace(struct sb_ctx *ctx, sb_trace_fn *fn, void *arg)
+{
+   ctx->trace = fn;
+   ctx->trace_arg = arg;
+}
+
+void sb_set_trace(struct sabir *sb, sb_trace_fn *fn, void *arg)
+{
+   sb_ctx_set_trace(&sb->ctx, fn, arg);
+}
+
+void sb_ctx_dealloc(struct sb_ctx *ctx)
+{
+   free(ctx);
 }
 
 static size_t sb_pad(size_t n, size_t align)
@@ -62,33 +321,336 @@ static size_t sb_pad(size_t n, size_t align)
    return (n + align - 1) & ~(align - 1);
 }
 
+/* Computes "a + b * c", rounded up to a multiple of "align". Returns false on
+ * overflow.
+ */
+static bool sb_offset(size_t *r, size_t a, size_t b, size_t c, size_t align)
+{
+   if (c && b > (SIZE_MAX - a - align) / c)
+      return false;
+   *r = sb_pad(a + b * c, align);
+   return true;
+}
+
+/* Reads a line made of "nr" unsigned decimal integers separated by spaces.
+ * This is much faster than fscanf(), which matters for large tables.
+ */
+static bool sb_read_ints(FILE *fp, uint64_t *vals, size_t nr)
+{
+   for (size_t i = 0; i < nr; i++) {
+      int c = getc(fp);
+      if (c < '0' || c > '9')
+         return false;
+      uint64_t n = 0;
+      do {
+         if (n > (UINT64_MAX - (c - '0')) / 10)
+            return false;
+         n = n * 10 + (c - '0');
+      } while ((c = getc(fp)) >= '0' && c <= '9');
+      if (c != (i + 1 < nr ? ' ' : '\n'))
+         return false;
+      vals[i] = n;
+   }
+   return true;
+}
+
 static bool sb_is_pow2(size_t n)
 {
    return n && (n & (n - 1)) == 0;
 }
 
-#define SB_MAX_LABELS 255
-#define SB_MAX_LABELS_LEN 2048
-#define SB_MAX_FEATURES 400000   /* Prevent overflow issues. */
+/* Returns the smallest power of two that is >= n. */
+static size_t sb_pow2_ceil(size_t n)
+{
+   size_t p = 1;
+   while (p < n)
+      p <<= 1;
+   return p;
+}
 
-int sb_load(struct sabir **sbp, const char *path)
+static uint32_t sb_hash_feature(const uint8_t s[static SB_NGRAM_SIZE], size_t pos)
+{
+   uint32_t h = 1315423911;
+   for (size_t i = 0; i < SB_NGRAM_SIZE; i++)
+      h ^= (h << 5) + s[(pos + i) % SB_NGRAM_SIZE] + (h >> 2);
+   return h;
+}
+
+static uint32_t sb_hash_lang(uint32_t h, uint32_t lang)
+{
+   h ^= (h << 5) + lang + (h >> 2);
+   return h;
+}
+
+/* Packs a quadgram into an integer, for the hot quadgrams cache. The result
+ * cannot be zero, because quadgrams never contain a null byte.
+ */
+static uint32_t sb_pack(const uint8_t s[static SB_NGRAM_SIZE], size_t pos)
+{
+   uint32_t key = 0;
+   for (size_t i = 0; i < SB_NGRAM_SIZE; i++)
+      key = key << 8 | s[(pos + i) % SB_NGRAM_SIZE];
+   return key;
+}
+
+static size_t sb_hot_slot(const struct sabir *sb, uint32_t key)
+{
+   return (uint32_t)(key * UINT32_C(2654435761)) >> sb->hot_shift;
+}
+
+/* Adds "n" to a count. With fixed-point scores, counts are stored in the same
+ * integers as scores, so we saturate them. That doesn't happen in practice.
+ */
+static void sb_add_count(sb_score *count, uint64_t n)
+{
+#ifdef SB_FIXED_POINT
+   *count = n < UINT32_MAX - *count ? *count + n : UINT32_MAX;
+#else
+   *count += n;
+#endif
+}
+
+/* Turns a count into a score. */
+static sb_score sb_log(sb_score count)
+{
+#ifdef SB_FIXED_POINT
+   return floor(log((double)count + 1) * SB_FIXED_SCALE + 0.5);
+#else
+   return log(count + 1);
+#endif
+}
+
+/* Reads the remainder of a line of the form:
+ *    % <script> [<script> ..]
+ * and fills "mask" with the corresponding scripts. Scripts that we don't know
+ * of make us consider that the label can be written in any script, and so
+ * does an empty list, which trainers write for labels whose letters all
+ * belong to the common script.
+ */
+static bool sb_read_scripts(FILE *fp, uint32_t *mask)
+{
+   char line[512];
+
+   if (!fgets(line, sizeof line, fp) || !strchr(line, '\n'))
+      return false;
+
+   *mask = 0;
+   for (char *name = line; *(name += strspn(name, " \n")); ) {
+      size_t len = strcspn(name, " \n");
+      name[len] = '\0';
+      int script = sb_script_find(name);
+      if (script < 0) {
+         *mask = UINT32_MAX;
+         break;
+      }
+      *mask |= UINT32_C(1) << script;
+      name += len + 1;
+   }
+   if (!*mask)
+      *mask = UINT32_MAX;
+   return true;
+}
+
+/* Reads the remainder of a line of the form:
+ *    & <num_clusters> <table_size> <num_entries>
+ * and the "<bucket> <count>" lines that follow.
+ */
+static bool sb_read_coarse(FILE *fp, struct sabir *sb)
+{
+   size_t num_clusters, table_size, num_entries;
+
+   if (fscanf(fp, " %zu %zu %zu\n", &num_clusters, &table_size, &num_entries) != 3)
+      return false;
+   if (num_clusters == 0 || num_clusters > SB_MAX_LABELS)
+      return false;
+   if (table_size > SB_MAX_FEATURES || !sb_is_pow2(table_size) || num_entries > table_size)
+      return false;
+
+   sb->coarse = calloc(table_size, sizeof *sb->coarse);
+   if (!sb->coarse)
+      return false;
+   sb->num_clusters = num_clusters;
+   sb->coarse_mask = table_size - 1;
+
+   for (size_t i = 0; i < num_entries; i++) {
+      uint64_t entry[2];
+      if (!sb_read_ints(fp, entry, 2))
+         return false;
+      if (entry[0] >= table_size || entry[1] > DBL_MAX - 1)
+         return false;
+      sb_add_count(&sb->coarse[entry[0]], entry[1]);
+   }
+   for (size_t i = 0; i < table_size; i++)
+      if (sb->coarse[i])
+         sb->coarse[i] = sb_log(sb->coarse[i]);
+   return true;
+}
+
+/* Returns the score of a quadgram for a label, given the hash of the quadgram.
+ * For building the hot quadgrams cache.
+ */
+static sb_score sb_lookup(const struct sabir *sb, uint32_t h1, size_t label)
+{
+   if (!sb->post_offs)
+      return sb->model[sb_hash_lang(h1, sb->ids[label]) & sb->table_mask];
+
+   size_t bucket = h1 & sb->table_mask;
+   for (size_t e = sb->post_offs[bucket]; e < sb->post_offs[bucket + 1]; e++)
+      if (sb->post_labels[e] == label)
+         return sb->post_scores[e];
+   return 0;
+}
+
+/* Reads a line made of a quadgram, in hexadecimal. */
+static bool sb_read_gram(FILE *fp, uint8_t gram[static SB_NGRAM_SIZE])
+{
+   for (size_t j = 0; j < SB_NGRAM_SIZE; j++) {
+      unsigned c;
+      if (fscanf(fp, "%2x", &c) != 1 || c == 0)
+         return false;
+      gram[j] = c;
+   }
+   return getc(fp) == '\n';
+}
+
+/* Reads the remainder of a line of the form:
+ *    * <num_quadgrams>
+ * and the quadgrams that follow, one per line, in hexadecimal, most frequent
+ * first. Their scores are computed from the features table, which must
+ * already be loaded, so that they are the same as if we looked them up. The
+ * cache is direct-mapped: when two quadgrams map to the same slot, the most
+ * frequent one wins.
+ */
+static bool sb_read_hot(FILE *fp, struct sabir *sb)
+{
+   size_t num_hot;
+
+   if (fscanf(fp, " %zu\n", &num_hot) != 1 || num_hot == 0 || num_hot > SB_MAX_HOT)
+      return false;
+
+   /* Keep the load factor at or below 1/2, and the scores within
+    * SB_HOT_BYTES. Quadgrams are listed most frequent first, so if there are
+    * too many of them, we only keep the first ones.
+    */
+   size_t num_slots = sb_pow2_ceil(2 * num_hot);
+   while (num_slots > 2 && num_slots * sb->num_labels * sizeof *sb->hot_scores > SB_HOT_BYTES)
+      num_slots /= 2;
+   size_t num_kept = num_hot < num_slots / 2 ? num_hot : num_slots / 2;
+   sb->hot_shift = 32;
+   for (size_t n = num_slots; n > 1; n >>= 1)
+      sb->hot_shift--;
+   sb->hot_keys = calloc(num_slots, sizeof *sb->hot_keys);
+   sb->hot_scores = calloc(num_slots * sb->num_labels, sizeof *sb->hot_scores);
+   if (!sb->hot_keys || !sb->hot_scores)
+      return false;
+
+   for (size_t i = 0; i < num_hot; i++) {
+      uint8_t gram[SB_NGRAM_SIZE];
+      if (!sb_read_gram(fp, gram))
+         return false;
+      if (i >= num_kept)
+         continue;
+      uint32_t key = sb_pack(gram, 0);
+      size_t slot = sb_hot_slot(sb, key);
+      if (sb->hot_keys[slot])
+         continue;
+      sb->hot_keys[slot] = key;
+      uint32_t h1 = sb_hash_feature(gram, 0);
+      for (size_t label = 0; label < sb->num_labels; label++)
+         sb->hot_scores[slot * sb->num_labels + label] = sb_lookup(sb, h1, label);
+   }
+   return true;
+}
+
+/* Sorts the features of a sparse model into posting lists. Features are given
+ * as (bucket, label, count) triples, grouped by label. Counts of the same label
+ * that end up in the same bucket are summed.
+ */
+static bool sb_build_postings(struct sabir *sb, size_t num,
+                              const uint32_t *buckets, const uint8_t *labels,
+                              const sb_score *counts)
+{
+   size_t num_buckets = sb->table_mask + 1;
+   uint32_t *offs = calloc(num_buckets + 1, sizeof *offs);
+   uint32_t *next = calloc(num_buckets, sizeof *next);
+   sb->post_offs = offs;
+   sb->post_labels = calloc(num + 1, sizeof *sb->post_labels);
+   sb->post_scores = calloc(num + 1, sizeof *sb->post_scores);
+   if (!offs || !next || !sb->post_labels || !sb->post_scores) {
+      free(next);
+      return false;
+   }
+
+   /* Counting sort. Since it is stable, labels end up sorted within buckets. */
+   for (size_t e = 0; e < num; e++)
+      offs[buckets[e] + 1]++;
+   for (size_t b = 0; b < num_buckets; b++) {
+      offs[b + 1] += offs[b];
+      next[b] = offs[b];
+   }
+   for (size_t e = 0; e < num; e++) {
+      uint32_t to = next[buckets[e]]++;
+      sb->post_labels[to] = labels[e];
+      sb->post_scores[to] = counts[e];
+   }
+   free(next);
+
+   /* Merge duplicates. */
+   size_t to = 0;
+   for (size_t b = 0; b < num_buckets; b++) {
+      size_t from = offs[b], end = offs[b + 1];
+      offs[b] = to;
+      for ( ; from < end; from++) {
+         if (to > offs[b] && sb->post_labels[to - 1] == sb->post_labels[from]) {
+            sb_add_count(&sb->post_scores[to - 1], sb->post_scores[from]);
+         } else {
+            sb->post_labels[to] = sb->post_labels[from];
+            sb->post_scores[to++] = sb->post_scores[from];
+         }
+      }
+   }
+   offs[num_buckets] = to;
+
+   for (size_t e = 0; e < to; e++)
+      sb->post_scores[e] = sb_log(sb->post_scores[e]);
+   return true;
+}
+
+/* Section sizes of a version 2 model, for a single label. */
+struct sb_section {
+   unsigned id;            /* Identifier used for hashing. */
+   size_t num_entries;     /* Number of non-zero buckets. */
+};
+
+int sb_load_subset(struct sabir **sbp, const char *path,
+                   const char *const *langs)
 {
    *sbp = NULL;
    struct sabir *sb = NULL;
 
+   /* Features of sparse models, before they are sorted into posting lists. */
+   uint32_t *tmp_buckets = NULL;
+   uint8_t *tmp_labels = NULL;
+   sb_score *tmp_counts = NULL;
+
    FILE *fp = fopen(path, "r");
    if (!fp)
       return SB_EOPEN;
 
    /* Magic identifier and version. */
-   if (fscanf(fp, "@ sabir 1\n") == EOF) {
+   int version;
+   if (fscanf(fp, "@ sabir %d\n", &version) != 1 || version < 1 || version > 2) {
       fclose(fp);
       return SB_EMAGIC;
    }
 
-   /* Sections size. */
+   /* Sections size, and layout of the features table. */
    size_t num_labels, labels_len, num_features;
-   if (fscanf(fp, "> %zu %zu %zu\n", &num_labels, &labels_len, &num_features) != 3)
+   char line[128], layout[16] = "";
+   if (!fgets(line, sizeof line, fp) || sscanf(line, "> %zu %zu %zu %15s", &num_labels, &labels_len, &num_features, layout) < 3)
+      goto bad_model;
+   bool sparse = !strcmp(layout, "sparse");
+   if (*layout && (!sparse || version == 1))
       goto bad_model;
    if (num_labels == 0 || num_labels > SB_MAX_LABELS)
       goto bad_model;
@@ -97,55 +659,239 @@ int sb_load(struct sabir **sbp, const char *path)
    if (num_features == 0 || num_features > SB_MAX_FEATURES || !sb_is_pow2(num_features))
       goto bad_model;
 
-   /* Compute memory offsets. */
-   size_t ptrs_off = sb_pad(offsetof(struct sabir, model) + num_features * sizeof(*sb->model), alignof(char *));
-   size_t strs_off = sb_pad(ptrs_off + (num_labels + 1) * sizeof(char **), alignof(char));
-   size_t probs_off = sb_pad(strs_off + labels_len + num_labels + 1, alignof(double));
-   size_t total = probs_off + num_labels * sizeof(double);
-
-   /* Initialize our struct. */
-   sb = malloc(total);
-   if (!sb) {
-      fclose(fp);
-      return SB_ENOMEM;
-   }
-   sb->num_labels = num_labels;
-   sb->table_mask = num_features - 1;
-   sb->labels = (void *)((char *)sb + ptrs_off);
-   sb->probs = (void *)((char *)sb + probs_off);
-   sb_init(sb);
-
-   char **ptrs = (void *)((char *)sb + ptrs_off);
-   char *strs = (void *)((char *)sb + strs_off);
-
-   /* Read labels. One per line. */
+   /* Read labels. One per line. We keep them on the stack for now, since we
+    * don't know yet how many of them we'll retain.
+    */
+   char all_strs[SB_MAX_LABELS_LEN + SB_MAX_LABELS + 1];
+   const char *all_ptrs[SB_MAX_LABELS];
    size_t pos = 0;
    for (size_t i = 0; i < num_labels; i++) {
-      char *line = fgets(&strs[pos], labels_len + num_labels + 1 - pos, fp);
+      char *line = fgets(&all_strs[pos], labels_len + num_labels + 1 - pos, fp);
       if (!line)
          goto bad_model;
       size_t len = strlen(line);
       if (len < 2 || line[len - 1] != '\n')
          goto bad_model;
       line[len - 1] = '\0';
-      ptrs[i] = &strs[pos];
+      all_ptrs[i] = &all_strs[pos];
       pos += len;
    }
-   ptrs[num_labels] = NULL;
    if (pos != labels_len + num_labels)
       goto bad_model;
 
-   /* Read features. One per line. */
-   for (size_t i = 0; i < num_features; i++) {
-      uint64_t n;
-      if (fscanf(fp, "%"SCNu64"\n", &n) != 1 || n > DBL_MAX - 1)
+   /* Select the labels to retain. */
+   bool keep[SB_MAX_LABELS];
+   size_t num_kept = 0, kept_len = 0;
+   for (size_t i = 0; i < num_labels; i++) {
+      keep[i] = !langs;
+      for (const char *const *lang = langs; lang && *lang; lang++)
+         if (!strcmp(*lang, all_ptrs[i]))
+            keep[i] = true;
+      if (keep[i]) {
+         num_kept++;
+         kept_len += strlen(all_ptrs[i]);
+      }
+   }
+   if (!num_kept) {
+      fclose(fp);
+      return SB_ENOLANG;
+   }
+
+   /* Sections directory. Version 1 models don't have one: their features are
+    * stored as a single table, which we have to load whole.
+    */
+   struct sb_section sections[SB_MAX_LABELS];
+   size_t table_size = num_features;
+   size_t kept_entries = 0;
+   if (version == 1) {
+      for (size_t i = 0; i < num_labels; i++)
+         sections[i].id = i;
+   } else {
+      size_t total_entries = 0;
+      for (size_t i = 0; i < num_labels; i++) {
+         struct sb_section *sec = &sections[i];
+         if (fscanf(fp, "= %u %zu\n", &sec->id, &sec->num_entries) != 2)
+            goto bad_model;
+         if (sec->id > UINT8_MAX || sec->num_entries > num_features)
+            goto bad_model;
+         total_entries += sec->num_entries;
+         if (keep[i])
+            kept_entries += sec->num_entries;
+      }
+      if (kept_entries >= UINT32_MAX)
+         goto bad_model;
+      /* Shrink the table in proportion to the number of features of the
+       * retained labels, so that the load factor stays the same. Buckets
+       * are folded onto each other, see below.
+       */
+      if (kept_entries < total_entries) {
+         double ratio = (double)kept_entries / total_entries;
+         table_size = sb_pow2_ceil(ratio * num_features);
+         if (table_size > num_features)
+            table_size = num_features;
+      }
+   }
+
+   /* Compute memory offsets. Sparse models don't need the hashed table. */
+   size_t hashed_size = sparse ? 0 : table_size;
+   size_t ptrs_off, strs_off, total;
+   bool ok = sb_offset(&ptrs_off, offsetof(struct sabir, model), hashed_size, sizeof(*sb->model), alignof(char *))
+          && sb_offset(&strs_off, ptrs_off, num_kept + 1, sizeof(char **), alignof(char))
+          && sb_offset(&total, strs_off, kept_len + num_kept + 1, 1, 1);
+
+   /* Initialize our struct. We use calloc() because with large tables, most
+    * buckets are empty, and the system can then map them to zero pages lazily.
+    */
+   sb = ok ? calloc(1, total) : NULL;
+   if (!sb) {
+      fclose(fp);
+      return SB_ENOMEM;
+   }
+   sb->num_labels = num_kept;
+   sb->table_mask = table_size - 1;
+   sb->num_clusters = 0;
+   sb->coarse = NULL;
+   sb->post_offs = NULL;
+   sb->post_labels = NULL;
+   sb->post_scores = NULL;
+   sb->hot_keys = NULL;
+   sb->hot_scores = NULL;
+   sb->labels = (void *)((char *)sb + ptrs_off);
+   atomic_init(&sb->refs, 1);
+   sb->serial = atomic_fetch_add(&sb_serial, 1) + 1;
+
+   char **ptrs = (void *)((char *)sb + ptrs_off);
+   char *strs = (void *)((char *)sb + strs_off);
+
+   /* Copy the retained labels. */
+   size_t kept_no[SB_MAX_LABELS];
+   pos = 0;
+   for (size_t i = 0, j = 0; i < num_labels; i++) {
+      if (!keep[i])
+         continue;
+      size_t len = strlen(all_ptrs[i]) + 1;
+      memcpy(&strs[pos], all_ptrs[i], len);
+      ptrs[j] = &strs[pos];
+      sb->ids[j] = sections[i].id;
+      sb->scripts[j] = UINT32_MAX;
+      sb->clusters[j] = 0;
+      kept_no[i] = j++;
+      pos += len;
+   }
+   sb->has_scripts = false;
+   ptrs[num_kept] = NULL;
+   sb_init(sb);
+
+   /* Read features. For version 1 models, one per line. For version 2 ones,
+    * one section per label, with one "<bucket> <count>" pair per line. We
+    * accumulate counts into the table first, and take their log afterwards.
+    * Since the table size is a power of two, and since the table index of a
+    * feature is its hash modulo the table size, adding bucket "i" of a table
+    * to bucket "i % table_size" of a smaller one yields the same table as if
+    * the model had been trained with the smaller size. The same holds for
+    * sparse models.
+    */
+   if (sparse) {
+      tmp_buckets = calloc(kept_entries + 1, sizeof *tmp_buckets);
+      tmp_labels = calloc(kept_entries + 1, sizeof *tmp_labels);
+      tmp_counts = calloc(kept_entries + 1, sizeof *tmp_counts);
+      if (!tmp_buckets || !tmp_labels || !tmp_counts)
          goto bad_model;
-      sb->model[i] = log(n + 1);
    }
+   size_t num_tmp = 0;
+   if (version == 1) {
+      for (size_t i = 0; i < num_features; i++) {
+         uint64_t n;
+         if (!sb_read_ints(fp, &n, 1) || n > DBL_MAX - 1)
+            goto bad_model;
+         sb_add_count(&sb->model[i], n);
+      }
+   } else {
+      for (size_t i = 0; i < num_labels; i++) {
+         for (size_t j = 0; j < sections[i].num_entries; j++) {
+            uint64_t entry[2];
+            if (!sb_read_ints(fp, entry, 2))
+               goto bad_model;
+            if (entry[0] >= num_features || entry[1] > DBL_MAX - 1)
+               goto bad_model;
+            size_t bucket = entry[0];
+            uint64_t n = entry[1];
+            if (!keep[i])
+               continue;
+            if (sparse) {
+               tmp_buckets[num_tmp] = bucket & sb->table_mask;
+               tmp_labels[num_tmp] = kept_no[i];
+               tmp_counts[num_tmp] = 0;
+               sb_add_count(&tmp_counts[num_tmp++], n);
+            } else {
+               sb_add_count(&sb->model[bucket & sb->table_mask], n);
+            }
+         }
+      }
+   }
+   for (size_t i = 0; i < hashed_size; i++)
+      if (sb->model[i])
+         sb->model[i] = sb_log(sb->model[i]);
+   if (sparse && !sb_build_postings(sb, num_tmp, tmp_buckets, tmp_labels, tmp_counts))
+      goto bad_model;
+   free(tmp_buckets);
+   free(tmp_labels);
+   free(tmp_counts);
+   tmp_buckets = NULL;
+   tmp_labels = NULL;
+   tmp_counts = NULL;
 
-   /* Should have reached the end of the file by now. */
-   if (getc(fp) != EOF)
+   /* Optional sections of version 2 models. Each line starts with a tag
+    * character that identifies the section it belongs to.
+    */
+   size_t num_scripts = 0, num_clustered = 0;
+   int tag;
+   while ((tag = getc(fp)) != EOF) {
+      if (version == 1)
+         goto bad_model;
+      switch (tag) {
+      case '%': {
+         /* Scripts used by each label, one line per label. */
+         uint32_t mask;
+         if (num_scripts == num_labels || !sb_read_scripts(fp, &mask))
+            goto bad_model;
+         if (keep[num_scripts])
+            sb->scripts[kept_no[num_scripts]] = mask;
+         num_scripts++;
+         break;
+      }
+      case '^': {
+         /* Cluster of each label, one line per label. */
+         unsigned cluster;
+         if (num_clustered == num_labels || fscanf(fp, " %u\n", &cluster) != 1 || cluster >= SB_MAX_LABELS)
+            goto bad_model;
+         if (keep[num_clustered])
+            sb->clusters[kept_no[num_clustered]] = cluster;
+         num_clustered++;
+         break;
+      }
+      case '&':
+         /* Cluster-level features table. */
+         if (sb->coarse || !sb_read_coarse(fp, sb))
+            goto bad_model;
+         break;
+      case '*':
+         /* Hot quadgrams. */
+         if (sb->hot_keys || !sb_read_hot(fp, sb))
+            goto bad_model;
+         break;
+      default:
+         goto bad_model;
+      }
+   }
+   if (num_scripts && num_scripts != num_labels)
+      goto bad_model;
+   sb->has_scripts = num_scripts;
+   if ((num_clustered || sb->coarse) && num_clustered != num_labels)
       goto bad_model;
+   for (size_t i = 0; i < sb->num_labels; i++)
+      if (num_clustered && sb->clusters[i] >= sb->num_clusters)
+         goto bad_model;
 
    *sbp = sb;
    fclose(fp);
@@ -154,37 +900,39 @@ int sb_load(struct sabir **sbp, const char *path)
 bad_model: {
    int err = ferror(fp);
    fclose(fp);
-   free(sb);
+   free(tmp_buckets);
+   free(tmp_labels);
+   free(tmp_counts);
+   sb_dealloc(sb);
    return err ? SB_EIO : SB_EMODEL;
 }
 }
 
+int sb_load(struct sabir **sbp, const char *path)
+{
+   return sb_load_subset(sbp, path, NULL);
+}
+
 void sb_dealloc(struct sabir *sb)
 {
+   if (sb) {
+      free(sb->coarse);
+      free(sb->post_offs);
+      free(sb->post_labels);
+      free(sb->post_scores);
+      free(sb->hot_keys);
+      free(sb->hot_scores);
+   }
    free(sb);
 }
 
-const char *const *sb_langs(struct sabir *sb, size_t *nr)
+const char *const *sb_langs(const struct sabir *sb, size_t *nr)
 {
    if (nr)
       *nr = sb->num_labels;
    return sb->labels;
 }
 
-static uint32_t sb_hash_feature(const uint8_t s[static SB_NGRAM_SIZE], size_t pos)
-{
-   uint32_t h = 1315423911;
-   for (size_t i = 0; i < SB_NGRAM_SIZE; i++)
-      h ^= (h << 5) + s[(pos + i) % SB_NGRAM_SIZE] + (h >> 2);
-   return h;
-}
-
-static uint32_t sb_hash_lang(uint32_t h, uint32_t lang)
-{
-   h ^= (h << 5) + lang + (h >> 2);
-   return h;
-}
-
 static bool sb_is_letter(int32_t c)
 {
    const utf8proc_property_t *p = utf8proc_get_property(c);
@@ -201,73 +949,378 @@ static bool sb_is_letter(int32_t c)
    }
 }
 
-static void sb_report(const uint8_t *gram, size_t pos, const char *lang,
-                      uint32_t hash, double prob)
+/* Calls the trace function of a context. This must only be called if
+ * "sb_debug" is true, and if there is such a function, so that tracing costs
+ * nothing otherwise.
+ */
+static void sb_report(const struct sb_ctx *ctx, const uint8_t *gram,
+                      size_t pos, size_t label, uint32_t hash, sb_score prob)
 {
-   for (size_t i = 0; i < SB_NGRAM_SIZE; i++) {
-      int c = gram[(pos + i) % SB_NGRAM_SIZE];
-      printf("%02x", c);
+   uint8_t ordered[SB_NGRAM_SIZE];
+
+   for (size_t i = 0; i < SB_NGRAM_SIZE; i++)
+      ordered[i] = gram[(pos + i) % SB_NGRAM_SIZE];
+   ctx->trace(ctx->trace_arg, ordered, ctx->sb->labels[label], hash, prob);
+}
+
+/* With the sparse layout, features are indexed by the hash of the quadgram
+ * alone, and each bucket holds the scores of the labels that have been seen
+ * with it. Missing labels have a count of zero, and thus a score of log(1) =
+ * 0, so we can skip them.
+ */
+static void sb_update_sparse(struct sb_ctx *ctx,
+                             const uint8_t gram[static SB_NGRAM_SIZE],
+                             size_t pos, uint32_t count)
+{
+   const struct sabir *sb = ctx->sb;
+   uint32_t h1 = sb_hash_feature(gram, pos);
+   size_t bucket = h1 & sb->table_mask;
+
+   sb_count(&ctx->stats.probes, 1 + sb->post_offs[bucket + 1] - sb->post_offs[bucket]);
+   for (size_t e = sb->post_offs[bucket]; e < sb->post_offs[bucket + 1]; e++) {
+      size_t i = sb->post_labels[e];
+      if (!ctx->is_active[i])
+         continue;
+      sb_score prob = sb->post_scores[e];
+      ctx->probs[i] += (sb_prob)count * prob;
+      if (sb_debug && ctx->trace)
+         sb_report(ctx, gram, pos, i, h1, prob);
    }
-   printf(" %s %"PRIu32" %la\n", lang, hash, prob);
 }
 
-static void sb_update_probs(struct sabir *sb,
-                            const uint8_t gram[static SB_NGRAM_SIZE],
-                            size_t pos)
+/* Looks up a quadgram in the hot quadgrams cache. Returns false if it isn't
+ * there.
+ */
+static bool sb_update_hot(struct sb_ctx *ctx,
+                          const uint8_t gram[static SB_NGRAM_SIZE],
+                          size_t pos, uint32_t count)
+{
+   const struct sabir *sb = ctx->sb;
+   uint32_t key = sb_pack(gram, pos);
+   size_t slot = sb_hot_slot(sb, key);
+
+   sb_count(&ctx->stats.probes, 1);
+   if (sb->hot_keys[slot] != key)
+      return false;
+
+   const sb_score *scores = &sb->hot_scores[slot * sb->num_labels];
+   for (size_t k = 0; k < ctx->num_active; k++) {
+      size_t i = ctx->active[k];
+      ctx->probs[i] += (sb_prob)count * scores[i];
+      if (sb_debug && ctx->trace) {
+         /* Report what the regular lookup would. */
+         uint32_t h1 = sb_hash_feature(gram, pos);
+         if (!sb->post_offs)
+            sb_report(ctx, gram, pos, i, sb_hash_lang(h1, sb->ids[i]), scores[i]);
+         else if (scores[i])
+            sb_report(ctx, gram, pos, i, h1, scores[i]);
+      }
+   }
+   return true;
+}
+
+/* Adds the scores of a quadgram that occurs "count" times. */
+static void sb_update_fine(struct sb_ctx *ctx,
+                           const uint8_t gram[static SB_NGRAM_SIZE],
+                           size_t pos, uint32_t count)
 {
+   const struct sabir *sb = ctx->sb;
+
+   sb_count(&ctx->stats.skipped, (size_t)count * (sb->num_labels - ctx->num_active));
+   if (sb->hot_keys && sb_update_hot(ctx, gram, pos, count))
+      return;
+
+   if (sb->post_offs) {
+      sb_update_sparse(ctx, gram, pos, count);
+      return;
+   }
+
    uint32_t h1 = sb_hash_feature(gram, pos);
+   sb_count(&ctx->stats.probes, ctx->num_active);
+   for (size_t k = 0; k < ctx->num_active; k++) {
+      size_t i = ctx->active[k];
+      uint32_t h2 = sb_hash_lang(h1, sb->ids[i]);
+      sb_score prob = sb->model[h2 & sb->table_mask];
+      ctx->probs[i] += (sb_prob)count * prob;
+      if (sb_debug && ctx->trace)
+         sb_report(ctx, gram, pos, i, h2, prob);
+   }
+}
 
-   for (size_t i = 0; i < sb->num_labels; i++) {
+/* Hierarchical models have a second, smaller features table, whose labels are
+ * clusters of languages. When we're given a text, we first score the clusters
+ * the labels to score belong to, and save the quadgrams we see. Once we have
+ * seen SB_COARSE_GRAMS quadgrams, or if the text is shorter than that, when
+ * sb_ctx_finish() is called, we choose the best matching cluster, drop labels
+ * that don't belong to it, and score the saved quadgrams as usual. From then
+ * on, only the labels of the chosen cluster are scored.
+ */
+static void sb_start_coarse(struct sb_ctx *ctx)
+{
+   const struct sabir *sb = ctx->sb;
+   bool seen[SB_MAX_LABELS] = {false};
+
+   for (size_t k = 0; k < ctx->num_active; k++)
+      seen[sb->clusters[ctx->active[k]]] = true;
+
+   ctx->num_active_clusters = 0;
+   for (size_t i = 0; i < sb->num_clusters; i++) {
+      if (seen[i]) {
+         ctx->active_clusters[ctx->num_active_clusters++] = i;
+         ctx->cluster_probs[i] = 0;
+      }
+   }
+   ctx->coarse_phase = ctx->num_active_clusters > 1;
+   ctx->num_grams = 0;
+}
+
+static void sb_choose_cluster(struct sb_ctx *ctx)
+{
+   const struct sabir *sb = ctx->sb;
+
+   ctx->coarse_phase = false;
+   if (!ctx->num_grams)
+      return;
+
+   size_t best = ctx->active_clusters[0];
+   for (size_t k = 1; k < ctx->num_active_clusters; k++) {
+      size_t i = ctx->active_clusters[k];
+      if (ctx->cluster_probs[i] > ctx->cluster_probs[best])
+         best = i;
+   }
+
+   bool wanted[SB_MAX_LABELS];
+   for (size_t i = 0; i < sb->num_labels; i++)
+      wanted[i] = sb->clusters[i] == best;
+   sb_narrow(ctx, wanted);
+
+   for (size_t i = 0; i < ctx->num_grams; i++)
+      sb_update_fine(ctx, ctx->grams[i], 0, 1);
+}
+
+static void sb_update_coarse(struct sb_ctx *ctx,
+                             const uint8_t gram[static SB_NGRAM_SIZE],
+                             size_t pos)
+{
+   const struct sabir *sb = ctx->sb;
+   uint32_t h1 = sb_hash_feature(gram, pos);
+
+   sb_count(&ctx->stats.probes, ctx->num_active_clusters);
+   for (size_t k = 0; k < ctx->num_active_clusters; k++) {
+      size_t i = ctx->active_clusters[k];
       uint32_t h2 = sb_hash_lang(h1, i);
-      double prob = sb->model[h2 & sb->table_mask];
-      sb->probs[i] += prob;
-      if (sb_debug && sb_verbose)
-         sb_report(gram, pos, sb->labels[i], h2, prob);
+      ctx->cluster_probs[i] += sb->coarse[h2 & sb->coarse_mask];
+   }
+
+   uint8_t *saved = ctx->grams[ctx->num_grams++];
+   for (size_t i = 0; i < SB_NGRAM_SIZE; i++)
+      saved[i] = gram[(pos + i) % SB_NGRAM_SIZE];
+   if (ctx->num_grams == SB_COARSE_GRAMS)
+      sb_choose_cluster(ctx);
+}
+
+/* Scores the quadgrams gathered by sb_dedup(), and empties its table. */
+static void sb_flush_dedup(struct sb_ctx *ctx)
+{
+   for (size_t i = 0; i < ctx->num_dedup; i++) {
+      size_t slot = ctx->dedup_used[i];
+      uint32_t key = ctx->dedup_slots[slot].key;
+      uint8_t gram[SB_NGRAM_SIZE];
+      for (size_t j = 0; j < SB_NGRAM_SIZE; j++)
+         gram[j] = key >> (SB_NGRAM_SIZE - 1 - j) * 8;
+      sb_update_fine(ctx, gram, 0, ctx->dedup_slots[slot].count);
+      ctx->dedup_slots[slot].key = 0;
+   }
+   ctx->num_dedup = 0;
+}
+
+/* In deduplication mode, instead of scoring quadgrams as they come, we count
+ * them in a hash table, and score each distinct quadgram once, multiplied by
+ * its count, at the end of each chunk of text, or earlier if the table fills
+ * up. Long texts contain many repeated quadgrams, so this saves many lookups.
+ * Since the order of additions changes, results can differ from those of the
+ * normal mode in the last bits.
+ */
+static void sb_dedup(struct sb_ctx *ctx,
+                     const uint8_t gram[static SB_NGRAM_SIZE],
+                     size_t pos)
+{
+   uint32_t key = sb_pack(gram, pos);
+   size_t slot = (uint32_t)(key * UINT32_C(2654435761)) % SB_DEDUP_SLOTS;
+
+   while (ctx->dedup_slots[slot].key) {
+      if (ctx->dedup_slots[slot].key == key) {
+         ctx->dedup_slots[slot].count++;
+         return;
+      }
+      slot = (slot + 1) % SB_DEDUP_SLOTS;
    }
+   ctx->dedup_slots[slot].key = key;
+   ctx->dedup_slots[slot].count = 1;
+   ctx->dedup_used[ctx->num_dedup++] = slot;
+   if (ctx->num_dedup == SB_DEDUP_MAX)
+      sb_flush_dedup(ctx);
 }
 
-static void sb_put_byte(struct sabir *sb, int c)
+static void sb_train(struct sb_trainer *,
+                     const uint8_t gram[static SB_NGRAM_SIZE], size_t pos);
+
+static void sb_update_probs(struct sb_ctx *ctx,
+                            const uint8_t gram[static SB_NGRAM_SIZE],
+                            size_t pos)
 {
-   sb->buf[sb->buf_pos++ % SB_NGRAM_SIZE] = c;
-   if (sb->buf_pos >= SB_NGRAM_SIZE)
-      sb_update_probs(sb, sb->buf, sb->buf_pos);
+   sb_count(&ctx->stats.grams, 1);
+   if (ctx->trainer)
+      sb_train(ctx->trainer, gram, pos);
+   else if (ctx->coarse_phase)
+      sb_update_coarse(ctx, gram, pos);
+   else if (ctx->dedup)
+      sb_dedup(ctx, gram, pos);
+   else
+      sb_update_fine(ctx, gram, pos, 1);
 }
 
-static ssize_t sb_complete(struct sabir *sb, const uint8_t *text, ssize_t len)
+static void sb_put_byte(struct sb_ctx *ctx, int c)
 {
-   ssize_t clen = utf8proc_utf8class[*sb->pending];
-   const ssize_t need = clen - sb->pending_have;
+   ctx->buf[ctx->buf_pos++ % SB_NGRAM_SIZE] = c;
+   if (ctx->buf_pos >= SB_NGRAM_SIZE)
+      sb_update_probs(ctx, ctx->buf, ctx->buf_pos);
+}
+
+static void sb_narrow_scripts(struct sb_ctx *);
+
+/* Counts the letters of each script, until there are enough of them to narrow
+ * the labels to score. This is done as letters come, so that the result
+ * doesn't depend on how the text is split into chunks.
+ */
+static void sb_count_letter(struct sb_ctx *ctx, int32_t c)
+{
+   if (!ctx->count_letters)
+      return;
+   ctx->letters[c < 0x80 ? SB_LATN : sb_script(c)]++;
+   if (++ctx->num_letters == SB_SCRIPT_LETTERS)
+      sb_narrow_scripts(ctx);
+}
+
+static ssize_t sb_complete(struct sb_ctx *ctx, const uint8_t *text, ssize_t len)
+{
+   ssize_t clen = utf8proc_utf8class[*ctx->pending];
+   const ssize_t need = clen - ctx->pending_have;
 
    if (need > len) {
       for (ssize_t j = 0; j < len; j++)
-         sb->pending[sb->pending_have++] = text[j];
+         ctx->pending[ctx->pending_have++] = text[j];
       return len;
    }
 
    for (ssize_t j = 0; j < need; j++)
-      sb->pending[sb->pending_have++] = text[j];
-   sb->pending_have = 0;
+      ctx->pending[ctx->pending_have++] = text[j];
+   ctx->pending_have = 0;
 
    int32_t c;
-   clen = utf8proc_iterate(sb->pending, clen, &c);
-   if (clen <= 0)
+   clen = utf8proc_iterate(ctx->pending, clen, &c);
+   if (clen <= 0) {
+      sb_count(&ctx->stats.invalid, 1);
       return 0;
-   
+   }
+
+   sb_count(&ctx->stats.code_points, 1);
    if (sb_is_letter(c)) {
+      sb_count(&ctx->stats.letters, 1);
+      sb_count_letter(ctx, c);
       for (ssize_t j = 0; j < clen; j++)
-         sb_put_byte(sb, sb->pending[j]);
+         sb_put_byte(ctx, ctx->pending[j]);
    } else {
-      sb_put_byte(sb, SB_PAD_CHAR);
-      sb->buf[0] = SB_PAD_CHAR;
-      sb->buf_pos = 1;      
+      sb_put_byte(ctx, SB_PAD_CHAR);
+      ctx->buf[0] = SB_PAD_CHAR;
+      ctx->buf_pos = 1;      
    }
    return need;
 }
 
-static void sb_process(struct sabir *sb, const uint8_t *text, ssize_t len)
+/* Adds the number of letters of each script found in a text to "counts",
+ * stopping after "max" letters. Returns the number of letters counted.
+ */
+static size_t sb_count_scripts(const uint8_t *text, ssize_t len,
+                               size_t counts[static SB_NUM_SCRIPTS], size_t max)
 {
+   size_t nr = 0;
+   ssize_t clen;
+
+   for (ssize_t i = 0; i < len && nr < max; i += clen) {
+      int32_t c;
+      clen = utf8proc_iterate(&text[i], len - i, &c);
+      if (clen <= 0) {
+         clen = 1;
+      } else if (c < 0x80) {
+         if ((uint32_t)((c | 0x20) - 'a') < 26) {
+            counts[SB_LATN]++;
+            nr++;
+         }
+      } else if (sb_is_letter(c)) {
+         counts[sb_script(c)]++;
+         nr++;
+      }
+   }
+   return nr;
+}
+
+/* Stops scoring the labels that have none of the scripts present in the
+ * letters counted so far, unless no label has them, and stops counting
+ * letters. This is done once per classification, after SB_SCRIPT_LETTERS
+ * letters, or when finishing if the text is shorter than that. Labels dropped
+ * midway through a text might have been partly scored, but they can't win, so
+ * the result is the same as if they had been dropped before scoring anything,
+ * as sb_ctx_detect() does.
+ */
+static void sb_narrow_scripts(struct sb_ctx *ctx)
+{
+   const struct sabir *sb = ctx->sb;
+
+   ctx->count_letters = false;
+
+   size_t total = 0;
+   for (int i = 0; i < SB_NUM_SCRIPTS; i++)
+      if (i != SB_ZYYY)
+         total += ctx->letters[i];
+   if (!total)
+      return;
+
+   uint32_t present = 0;
+   for (int i = 0; i < SB_NUM_SCRIPTS; i++)
+      if (i != SB_ZYYY && ctx->letters[i] * SB_SCRIPT_SHARE >= total)
+         present |= UINT32_C(1) << i;
+
+   bool wanted[SB_MAX_LABELS];
+   for (size_t i = 0; i < sb->num_labels; i++)
+      wanted[i] = sb->scripts[i] & present;
+   if (!sb_narrow(ctx, wanted) || !ctx->coarse_phase)
+      return;
+
+   /* Clusters left without labels to score can't be chosen either. */
+   bool seen[SB_MAX_LABELS] = {false};
+   for (size_t k = 0; k < ctx->num_active; k++)
+      seen[sb->clusters[ctx->active[k]]] = true;
+   size_t j = 0;
+   for (size_t k = 0; k < ctx->num_active_clusters; k++)
+      if (seen[ctx->active_clusters[k]])
+         ctx->active_clusters[j++] = ctx->active_clusters[k];
+   ctx->num_active_clusters = j;
+   if (j < 2)
+      sb_choose_cluster(ctx);
+}
+
+static void sb_process(struct sb_ctx *ctx, const uint8_t *text, ssize_t len)
+{
+   if (!ctx->started && !ctx->trainer) {
+      ctx->started = true;
+      sb_start_coarse(ctx);
+   }
+
+   sb_count(&ctx->stats.bytes, len);
+
    /* Complete the last truncated UTF-8 sequence if applicable. */
-   ssize_t i = sb->pending_have ? sb_complete(sb, text, len) : 0;
+   ssize_t i = ctx->pending_have ? sb_complete(ctx, text, len) : 0;
    ssize_t clen;
 
    for ( ; i < len; i += clen) {
@@ -281,53 +1334,886 @@ static void sb_process(struct sabir *sb, const uint8_t *text, ssize_t len)
           */
          clen = utf8proc_utf8class[text[i]];
          if (i + clen > len) {
-            sb->pending_have = len - i;
-            for (ssize_t j = 0; j < sb->pending_have; j++)
-               sb->pending[j] = text[i + j];
+            sb_count(&ctx->stats.truncated, 1);
+            ctx->pending_have = len - i;
+            for (ssize_t j = 0; j < ctx->pending_have; j++)
+               ctx->pending[j] = text[i + j];
             break;
          }
+         sb_count(&ctx->stats.invalid, 1);
          clen = 1;
          continue;
       }
+      sb_count(&ctx->stats.code_points, 1);
       if (sb_is_letter(c)) {
+         sb_count(&ctx->stats.letters, 1);
+         sb_count_letter(ctx, c);
          for (ssize_t j = 0; j < clen; j++)
-            sb_put_byte(sb, text[i + j]);
+            sb_put_byte(ctx, text[i + j]);
       } else {
-         sb_put_byte(sb, SB_PAD_CHAR);
-         sb->buf[0] = SB_PAD_CHAR;
-         sb->buf_pos = 1;
+         sb_put_byte(ctx, SB_PAD_CHAR);
+         ctx->buf[0] = SB_PAD_CHAR;
+         ctx->buf_pos = 1;
       }
    }
+   sb_flush_dedup(ctx);
 }
 
 #ifndef SSIZE_MAX
    #define SSIZE_MAX (SIZE_MAX / 2)
 #endif
 
-void sb_feed(struct sabir *sb, const void *chunk, size_t len)
+void sb_ctx_feed(struct sb_ctx *ctx, const void *chunk, size_t len)
 {
-   sb_process(sb, chunk, len < SSIZE_MAX ? len : SSIZE_MAX);
+   sb_process(ctx, chunk, len < SSIZE_MAX ? len : SSIZE_MAX);
 }
 
-const char *sb_finish(struct sabir *sb)
+void sb_ctx_feed_grams(struct sb_ctx *ctx, const void *grams, size_t num)
+{
+   const uint8_t *gram = grams;
+
+   if (!ctx->started) {
+      ctx->started = true;
+      sb_start_coarse(ctx);
+   }
+   /* Zero keys mark empty slots, see sb_feed_grams(). */
+   for (size_t i = 0; i < num; i++, gram += SB_NGRAM_SIZE)
+      if (sb_pack(gram, 0))
+         sb_update_probs(ctx, gram, 0);
+   sb_flush_dedup(ctx);
+}
+
+const char *sb_ctx_finish(struct sb_ctx *ctx)
 {
+   const struct sabir *sb = ctx->sb;
+
    /* Handle the last ngram. */
-   sb_put_byte(sb, SB_PAD_CHAR);
+   sb_put_byte(ctx, SB_PAD_CHAR);
 
    /* Just in case the caller attempts to call this function several times. */
-   sb->buf_pos = 0;
+   ctx->buf_pos = 0;
 
-   size_t best = 0;
-   for (size_t i = 0; i < sb->num_labels; i++)
-      if (sb->probs[i] > sb->probs[best])
+   if (ctx->count_letters)
+      sb_narrow_scripts(ctx);
+   if (ctx->coarse_phase)
+      sb_choose_cluster(ctx);
+   sb_flush_dedup(ctx);
+
+   size_t best = ctx->active[0];
+   for (size_t k = 1; k < ctx->num_active; k++) {
+      size_t i = ctx->active[k];
+      if (ctx->probs[i] > ctx->probs[best])
          best = i;
+   }
 
    return sb->labels[best];
 }
 
+const char *sb_ctx_detect(struct sb_ctx *ctx, const struct sabir *sb,
+                          const void *text, size_t len)
+{
+   ssize_t n = len < SSIZE_MAX ? len : SSIZE_MAX;
+
+   /* The whole text is available, so we can narrow the labels to score by
+    * script before scoring anything, with the same letters as when the text is
+    * fed in chunks.
+    */
+   sb_ctx_init(ctx, sb);
+   if (ctx->count_letters) {
+      ctx->num_letters = sb_count_scripts(text, n, ctx->letters, SB_SCRIPT_LETTERS);
+      sb_narrow_scripts(ctx);
+   }
+   sb_process(ctx, text, n);
+   return sb_ctx_finish(ctx);
+}
+
+void sb_feed(struct sabir *sb, const void *chunk, size_t len)
+{
+   sb_ctx_feed(&sb->ctx, chunk, len);
+}
+
+void sb_feed_grams(struct sabir *sb, const void *grams, size_t num)
+{
+   sb_ctx_feed_grams(&sb->ctx, grams, num);
+}
+
+const char *sb_finish(struct sabir *sb)
+{
+   return sb_ctx_finish(&sb->ctx);
+}
+
 const char *sb_detect(struct sabir *sb, const void *text, size_t len)
 {
-   sb_init(sb);
-   sb_process(sb, text, len < SSIZE_MAX ? len : SSIZE_MAX);
-   return sb_finish(sb);
+   return sb_ctx_detect(&sb->ctx, sb, text, len);
+}
+
+int sb_live_new(struct sb_live **livep, struct sabir *sb)
+{
+   struct sb_live *live = malloc(sizeof *live);
+   *livep = live;
+   if (!live)
+      return SB_ENOMEM;
+
+   atomic_init(&live->current, sb);
+   atomic_init(&live->epoch, 0);
+   atomic_init(&live->pins[0], 0);
+   atomic_init(&live->pins[1], 0);
+   atomic_flag_clear(&live->publishing);
+   return SB_OK;
+}
+
+void sb_live_dealloc(struct sb_live *live)
+{
+   if (live) {
+      sb_live_release(atomic_load(&live->current));
+      free(live);
+   }
+}
+
+/* Readers pin the current epoch while they are fetching the current model and
+ * incrementing its reference count. A publisher swaps the model, moves on to
+ * the next epoch, and then waits until no reader is pinning the previous one.
+ * After that, no reader can still be about to grab a reference to the old
+ * model, so the publisher can drop its own reference to it.
+ */
+const struct sabir *sb_live_acquire(struct sb_live *live)
+{
+   unsigned epoch;
+
+   for (;;) {
+      epoch = atomic_load(&live->epoch);
+      atomic_fetch_add(&live->pins[epoch & 1], 1);
+      if (atomic_load(&live->epoch) == epoch)
+         break;
+      /* A model was published in the meantime. */
+      atomic_fetch_sub(&live->pins[epoch & 1], 1);
+   }
+   struct sabir *sb = atomic_load(&live->current);
+   atomic_fetch_add(&sb->refs, 1);
+   atomic_fetch_sub(&live->pins[epoch & 1], 1);
+   return sb;
+}
+
+void sb_live_release(const struct sabir *sb)
+{
+   struct sabir *mut = (struct sabir *)sb;
+
+   if (atomic_fetch_sub(&mut->refs, 1) == 1)
+      sb_dealloc(mut);
+}
+
+void sb_live_publish(struct sb_live *live, struct sabir *sb)
+{
+   /* Publishers are serialized. */
+   while (atomic_flag_test_and_set(&live->publishing))
+      thrd_yield();
+
+   struct sabir *old = atomic_exchange(&live->current, sb);
+   unsigned epoch = atomic_fetch_add(&live->epoch, 1);
+   while (atomic_load(&live->pins[epoch & 1]))
+      thrd_yield();
+
+   atomic_flag_clear(&live->publishing);
+   sb_live_release(old);
+}
+
+int sb_cache_new(struct sb_cache **cachep, size_t capacity)
+{
+   size_t num_sets = sb_pow2_ceil((capacity + SB_CACHE_WAYS - 1) / SB_CACHE_WAYS);
+   size_t total;
+
+   *cachep = NULL;
+   if (!sb_offset(&total, offsetof(struct sb_cache, sets), num_sets, sizeof(struct sb_cache_set), 1))
+      return SB_ENOMEM;
+   struct sb_cache *cache = calloc(1, total);
+   if (!cache)
+      return SB_ENOMEM;
+
+   cache->set_mask = num_sets - 1;
+   atomic_init(&cache->hits, 0);
+   atomic_init(&cache->misses, 0);
+   for (size_t i = 0; i < num_sets; i++) {
+      if (mtx_init(&cache->sets[i].lock, mtx_plain) != thrd_success) {
+         while (i--)
+            mtx_destroy(&cache->sets[i].lock);
+         free(cache);
+         return SB_ENOMEM;
+      }
+   }
+   *cachep = cache;
+   return SB_OK;
+}
+
+void sb_cache_dealloc(struct sb_cache *cache)
+{
+   if (cache) {
+      for (size_t i = 0; i <= cache->set_mask; i++)
+         mtx_destroy(&cache->sets[i].lock);
+   }
+   free(cache);
+}
+
+void sb_cache_stats(struct sb_cache *cache, size_t *hits, size_t *misses)
+{
+   if (hits)
+      *hits = atomic_load(&cache->hits);
+   if (misses)
+      *misses = atomic_load(&cache->misses);
+}
+
+/* 64-bit hash of a string, 8 bytes at a time. The final mix is the one of
+ * MurmurHash3.
+ */
+static uint64_t sb_hash_text(const uint8_t *text, size_t len)
+{
+   const uint64_t mul = UINT64_C(0xff51afd7ed558ccd);
+   uint64_t h = UINT64_C(0x9e3779b97f4a7c15) ^ len;
+   uint64_t word;
+
+   for ( ; len >= sizeof word; text += sizeof word, len -= sizeof word) {
+      memcpy(&word, text, sizeof word);
+      h = (h ^ word) * mul;
+      h ^= h >> 32;
+   }
+   word = 0;
+   if (len)
+      memcpy(&word, text, len);
+   h = (h ^ word) * mul;
+
+   h ^= h >> 33;
+   h *= mul;
+   h ^= h >> 33;
+   h *= UINT64_C(0xc4ceb9fe1a85ec53);
+   h ^= h >> 33;
+   return h;
+}
+
+/* The cache is set-associative. Each set is protected by its own lock, which
+ * is not held while classifying, so that threads rarely contend. Entries are
+ * keyed by the hash of a text and by the serial number of the model used to
+ * classify it, so a cache can be shared by several models, or used with a
+ * live handle. We store label indexes rather than pointers to labels: the
+ * latter might have been deallocated along with their model.
+ */
+const char *sb_cache_detect(struct sb_cache *cache, struct sb_ctx *ctx,
+                            const struct sabir *sb,
+                            const void *text, size_t len)
+{
+   uint64_t hash = sb_hash_text(text, len);
+   struct sb_cache_set *set = &cache->sets[(hash ^ sb->serial * UINT64_C(0x9e3779b97f4a7c15)) & cache->set_mask];
+
+   mtx_lock(&set->lock);
+   for (size_t w = 0; w < SB_CACHE_WAYS; w++) {
+      if (set->ways[w].hash == hash && set->ways[w].serial == sb->serial) {
+         set->ways[w].stamp = ++set->clock;
+         size_t label = set->ways[w].label;
+         mtx_unlock(&set->lock);
+         atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+         return sb->labels[label];
+      }
+   }
+   mtx_unlock(&set->lock);
+   atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+   const char *lang = sb_ctx_detect(ctx, sb, text, len);
+   size_t label = 0;
+   while (sb->labels[label] != lang)
+      label++;
+
+   /* Replace the least recently used entry. Empty ones have a zero stamp,
+    * unless the clock wrapped around, which is harmless.
+    */
+   mtx_lock(&set->lock);
+   size_t victim = 0;
+   for (size_t w = 0; w < SB_CACHE_WAYS; w++) {
+      if (set->ways[w].hash == hash && set->ways[w].serial == sb->serial) {
+         /* Another thread was quicker. */
+         victim = w;
+         break;
+      }
+      if ((uint32_t)(set->clock - set->ways[w].stamp) > (uint32_t)(set->clock - set->ways[victim].stamp))
+         victim = w;
+   }
+   set->ways[victim].hash = hash;
+   set->ways[victim].serial = sb->serial;
+   set->ways[victim].stamp = ++set->clock;
+   set->ways[victim].label = label;
+   mtx_unlock(&set->lock);
+   return lang;
+}
+
+/* Number of hot quadgrams of the models written by a trainer. Must match the
+ * default of sabir-train.
+ */
+#define SB_TRAIN_HOT 256
+
+/* Scripts that account for less than 1/SB_TRAIN_SCRIPT_SHARE of the letters
+ * of a language are not recorded in the models written by a trainer.
+ */
+#define SB_TRAIN_SCRIPT_SHARE 100
+
+/* A feature of a trainer, or a count of the model it started from. */
+struct sb_entry {
+   uint64_t key;                    /* See below. */
+   uint64_t count;
+};
+
+/* The size of the features table of a new model, and thus the buckets of its
+ * features, are only known once all texts have been seen. So a trainer counts
+ * features in a hash table, keyed by "quadgram << 8 | label", where "quadgram"
+ * is packed as with sb_pack(). The counts of the model a trainer starts from,
+ * if any, are kept apart, keyed by "bucket << 8 | label".
+ */
+struct sb_trainer {
+   int version;                     /* Model format version. */
+   bool sparse;                     /* Layout. */
+   size_t table_size;               /* Zero if not determined yet. */
+   bool loaded;                     /* Whether we started from a model. */
+   size_t num_labels;
+   char *labels[SB_MAX_LABELS];
+   int ids[SB_MAX_LABELS];          /* For hashing. -1 if not assigned yet. */
+   bool has_scripts;                /* Whether "scripts" is meaningful. */
+   uint32_t scripts[SB_MAX_LABELS]; /* Scripts of the model we started from. */
+   size_t letters[SB_MAX_LABELS][SB_NUM_SCRIPTS];
+   size_t num_base;
+   struct sb_entry *base;           /* Counts of the model we started from. */
+   size_t num_hot;
+   uint32_t *hot;                   /* Hot quadgrams of that model. */
+   size_t feature_mask;
+   size_t num_features;
+   struct sb_entry *features;       /* Empty slots have a zero key. */
+   size_t label;                    /* Label being fed. */
+   bool failed;                     /* Whether we ran out of memory. */
+   struct sb_ctx ctx;
+};
+
+int sb_trainer_new(struct sb_trainer **trp, int sparse, size_t buckets)
+{
+   struct sb_trainer *tr = calloc(1, sizeof *tr);
+   *trp = tr;
+   if (!tr)
+      return SB_ENOMEM;
+
+   tr->feature_mask = 1023;
+   tr->features = calloc(tr->feature_mask + 1, sizeof *tr->features);
+   if (!tr->features) {
+      free(tr);
+      *trp = NULL;
+      return SB_ENOMEM;
+   }
+   tr->version = 2;
+   tr->sparse = sparse;
+   if (buckets)
+      tr->table_size = sb_pow2_ceil(buckets < SB_MAX_FEATURES ? buckets : SB_MAX_FEATURES);
+   tr->ctx.trainer = tr;
+   return SB_OK;
+}
+
+void sb_trainer_dealloc(struct sb_trainer *tr)
+{
+   if (tr) {
+      for (size_t i = 0; i < tr->num_labels; i++)
+         free(tr->labels[i]);
+      free(tr->base);
+      free(tr->hot);
+      free(tr->features);
+   }
+   free(tr);
+}
+
+/* Appends a label, which must not be there already. */
+static int sb_trainer_add_label(struct sb_trainer *tr, const char *lang, int id)
+{
+   size_t len = strlen(lang), total = len;
+
+   if (!len || strchr(lang, '\n') || tr->num_labels == SB_MAX_LABELS)
+      return SB_ENOLANG;
+   for (size_t i = 0; i < tr->num_labels; i++)
+      total += strlen(tr->labels[i]);
+   if (total > SB_MAX_LABELS_LEN)
+      return SB_ENOLANG;
+
+   char *copy = malloc(len + 1);
+   if (!copy)
+      return SB_ENOMEM;
+   memcpy(copy, lang, len + 1);
+   tr->labels[tr->num_labels] = copy;
+   tr->ids[tr->num_labels++] = id;
+   return SB_OK;
+}
+
+static bool sb_trainer_push_base(struct sb_trainer *tr, size_t *cap,
+                                 uint64_t key, uint64_t count)
+{
+   if (tr->num_base == *cap) {
+      size_t new_cap = *cap ? 2 * *cap : 1024;
+      struct sb_entry *base = realloc(tr->base, new_cap * sizeof *base);
+      if (!base)
+         return false;
+      tr->base = base;
+      *cap = new_cap;
+   }
+   tr->base[tr->num_base++] = (struct sb_entry){key, count};
+   return true;
+}
+
+/* Reads a model, keeping its raw counts. Hierarchical models are not
+ * supported.
+ */
+int sb_trainer_load(struct sb_trainer **trp, const char *path)
+{
+   *trp = NULL;
+   struct sb_trainer *tr = NULL;
+
+   FILE *fp = fopen(path, "r");
+   if (!fp)
+      return SB_EOPEN;
+
+   int version;
+   if (fscanf(fp, "@ sabir %d\n", &version) != 1 || version < 1 || version > 2) {
+      fclose(fp);
+      return SB_EMAGIC;
+   }
+   if (sb_trainer_new(&tr, false, 0)) {
+      fclose(fp);
+      return SB_ENOMEM;
+   }
+   tr->version = version;
+   tr->loaded = true;
+
+   size_t num_labels, labels_len, num_features;
+   char line[128], layout[16] = "";
+   if (!fgets(line, sizeof line, fp) || sscanf(line, "> %zu %zu %zu %15s", &num_labels, &labels_len, &num_features, layout) < 3)
+      goto bad_model;
+   tr->sparse = !strcmp(layout, "sparse");
+   if (*layout && (!tr->sparse || version == 1))
+      goto bad_model;
+   if (num_labels == 0 || num_labels > SB_MAX_LABELS)
+      goto bad_model;
+   if (num_features == 0 || num_features > SB_MAX_FEATURES || !sb_is_pow2(num_features))
+      goto bad_model;
+   tr->table_size = num_features;
+
+   size_t total_len = 0;
+   for (size_t i = 0; i < num_labels; i++) {
+      char name[SB_MAX_LABELS_LEN + 2];
+      if (!fgets(name, sizeof name, fp))
+         goto bad_model;
+      size_t len = strlen(name);
+      if (len < 2 || name[len - 1] != '\n')
+         goto bad_model;
+      name[len - 1] = '\0';
+      for (size_t j = 0; j < i; j++)
+         if (!strcmp(tr->labels[j], name))
+            goto bad_model;
+      if (sb_trainer_add_label(tr, name, i))
+         goto bad_model;
+      total_len += len - 1;
+   }
+   if (total_len != labels_len)
+      goto bad_model;
+
+   size_t cap = 0;
+   if (version == 1) {
+      for (size_t i = 0; i < num_features; i++) {
+         uint64_t n;
+         if (!sb_read_ints(fp, &n, 1))
+            goto bad_model;
+         if (n && !sb_trainer_push_base(tr, &cap, (uint64_t)i << 8, n))
+            goto bad_model;
+      }
+   } else {
+      size_t num_entries[SB_MAX_LABELS];
+      bool used[UINT8_MAX + 1] = {false};
+      for (size_t i = 0; i < num_labels; i++) {
+         unsigned id;
+         if (fscanf(fp, "= %u %zu\n", &id, &num_entries[i]) != 2)
+            goto bad_model;
+         if (id > UINT8_MAX || used[id] || num_entries[i] > num_features)
+            goto bad_model;
+         used[id] = true;
+         tr->ids[i] = id;
+      }
+      for (size_t i = 0; i < num_labels; i++) {
+         for (size_t j = 0; j < num_entries[i]; j++) {
+            uint64_t entry[2];
+            if (!sb_read_ints(fp, entry, 2) || entry[0] >= num_features)
+               goto bad_model;
+            if (!sb_trainer_push_base(tr, &cap, entry[0] << 8 | i, entry[1]))
+               goto bad_model;
+         }
+      }
+   }
+
+   size_t num_scripts = 0;
+   int tag;
+   while ((tag = getc(fp)) != EOF) {
+      if (version == 1)
+         goto bad_model;
+      switch (tag) {
+      case '%':
+         if (num_scripts == num_labels || !sb_read_scripts(fp, &tr->scripts[num_scripts++]))
+            goto bad_model;
+         break;
+      case '*':
+         if (tr->hot || fscanf(fp, " %zu\n", &tr->num_hot) != 1 || tr->num_hot == 0 || tr->num_hot > SB_MAX_HOT)
+            goto bad_model;
+         tr->hot = malloc(tr->num_hot * sizeof *tr->hot);
+         if (!tr->hot)
+            goto bad_model;
+         for (size_t i = 0; i < tr->num_hot; i++) {
+            uint8_t gram[SB_NGRAM_SIZE];
+            if (!sb_read_gram(fp, gram))
+               goto bad_model;
+            tr->hot[i] = sb_pack(gram, 0);
+         }
+         break;
+      default:
+         /* Including the sections of hierarchical models. */
+         goto bad_model;
+      }
+   }
+   if (num_scripts && num_scripts != num_labels)
+      goto bad_model;
+   tr->has_scripts = num_scripts;
+
+   *trp = tr;
+   fclose(fp);
+   return SB_OK;
+
+bad_model: {
+   int err = ferror(fp);
+   fclose(fp);
+   sb_trainer_dealloc(tr);
+   return err ? SB_EIO : SB_EMODEL;
+}
+}
+
+static size_t sb_feature_slot(uint64_t key, size_t mask)
+{
+   return (size_t)(key * UINT64_C(0x9e3779b97f4a7c15) >> 32) & mask;
+}
+
+static bool sb_grow_features(struct sb_trainer *tr)
+{
+   size_t mask = 2 * tr->feature_mask + 1;
+   struct sb_entry *features = calloc(mask + 1, sizeof *features);
+   if (!features)
+      return false;
+
+   for (size_t i = 0; i <= tr->feature_mask; i++) {
+      if (!tr->features[i].key)
+         continue;
+      size_t slot = sb_feature_slot(tr->features[i].key, mask);
+      while (features[slot].key)
+         slot = (slot + 1) & mask;
+      features[slot] = tr->features[i];
+   }
+   free(tr->features);
+   tr->features = features;
+   tr->feature_mask = mask;
+   return true;
+}
+
+/* Called by sb_update_probs() for each quadgram of the text being fed. */
+static void sb_train(struct sb_trainer *tr,
+                     const uint8_t gram[static SB_NGRAM_SIZE], size_t pos)
+{
+   if (2 * tr->num_features > tr->feature_mask && !sb_grow_features(tr)) {
+      tr->failed = true;
+      return;
+   }
+
+   uint64_t key = (uint64_t)sb_pack(gram, pos) << 8 | tr->label;
+   size_t slot = sb_feature_slot(key, tr->feature_mask);
+   while (tr->features[slot].key && tr->features[slot].key != key)
+      slot = (slot + 1) & tr->feature_mask;
+   if (!tr->features[slot].key) {
+      tr->features[slot].key = key;
+      tr->num_features++;
+   }
+   tr->features[slot].count++;
+}
+
+int sb_trainer_feed(struct sb_trainer *tr, const char *lang,
+                    const void *text, size_t len)
+{
+   size_t label = 0;
+   while (label < tr->num_labels && strcmp(tr->labels[label], lang))
+      label++;
+   if (label == tr->num_labels) {
+      /* Version 1 models identify labels by their position. */
+      if (tr->version == 1)
+         return SB_ENOLANG;
+      int err = sb_trainer_add_label(tr, lang, -1);
+      if (err)
+         return err;
+   }
+
+   /* Extract quadgrams exactly as when classifying. See sb_ctx_init() and
+    * sb_ctx_finish().
+    */
+   struct sb_ctx *ctx = &tr->ctx;
+   ssize_t n = len < SSIZE_MAX ? len : SSIZE_MAX;
+   tr->label = label;
+   ctx->buf[0] = SB_PAD_CHAR;
+   ctx->buf_pos = 1;
+   ctx->pending_have = 0;
+   sb_count_scripts(text, n, tr->letters[label], SIZE_MAX);
+   sb_process(ctx, text, n);
+   sb_put_byte(ctx, SB_PAD_CHAR);
+   return tr->failed ? SB_ENOMEM : SB_OK;
+}
+
+/* Since the table size is a power of two, and since the table index of a
+ * feature is its hash modulo the table size, adding bucket "i" of a table to
+ * bucket "i % buckets" of a smaller one yields the same table as if the model
+ * had been trained with the smaller size. See sb_load_subset(). We do that
+ * when writing the model.
+ */
+void sb_trainer_fold(struct sb_trainer *tr, size_t buckets)
+{
+   if (!buckets)
+      return;
+   buckets = sb_pow2_ceil(buckets < SB_MAX_FEATURES ? buckets : SB_MAX_FEATURES);
+   if (!tr->table_size || buckets < tr->table_size)
+      tr->table_size = buckets;
+}
+
+size_t sb_trainer_buckets(const struct sb_trainer *tr)
+{
+   return tr->table_size;
+}
+
+static int sb_cmp_entries(const void *a, const void *b)
+{
+   const struct sb_entry *x = a, *y = b;
+
+   if (x->key != y->key)
+      return x->key < y->key ? -1 : 1;
+   return 0;
+}
+
+/* Most frequent first. Ties are broken by quadgram, as in sabir-train. */
+static int sb_cmp_hot(const void *a, const void *b)
+{
+   const struct sb_entry *x = a, *y = b;
+
+   if (x->count != y->count)
+      return x->count > y->count ? -1 : 1;
+   return sb_cmp_entries(a, b);
+}
+
+/* Writes the scripts of a label, as read by sb_read_scripts(). An empty list
+ * stands for any script.
+ */
+static void sb_write_scripts(FILE *fp, uint32_t mask)
+{
+   putc('%', fp);
+   for (int i = 0; mask != UINT32_MAX && i < SB_NUM_SCRIPTS; i++)
+      if (i != SB_ZYYY && (mask >> i & 1))
+         fprintf(fp, " %s", sb_script_name(i));
+   putc('\n', fp);
+}
+
+static uint32_t sb_trainer_scripts(const struct sb_trainer *tr, size_t label)
+{
+   const size_t *letters = tr->letters[label];
+   size_t total = 0;
+   for (int i = 0; i < SB_NUM_SCRIPTS; i++)
+      if (i != SB_ZYYY)
+         total += letters[i];
+
+   uint32_t mask = tr->has_scripts && tr->ids[label] >= 0 ? tr->scripts[label] : 0;
+   for (int i = 0; i < SB_NUM_SCRIPTS; i++)
+      if (i != SB_ZYYY && letters[i] && letters[i] * SB_TRAIN_SCRIPT_SHARE >= total)
+         mask |= UINT32_C(1) << i;
+   return mask;
+}
+
+/* Writes the hot quadgrams section. For new models, these are the most
+ * frequent quadgrams. "features" must be sorted by key.
+ */
+/* Sums the counts of each quadgram of "features", which must be sorted, over
+ * labels, and sorts the sums by decreasing count. This is done in place.
+ * Returns the number of hot quadgrams, which come first.
+ */
+static size_t sb_trainer_sum_hot(struct sb_entry *features, size_t num)
+{
+   size_t num_grams = 0;
+   for (size_t i = 0; i < num; i++) {
+      uint64_t key = features[i].key >> 8;
+      if (num_grams && features[num_grams - 1].key == key)
+         features[num_grams - 1].count += features[i].count;
+      else
+         features[num_grams++] = (struct sb_entry){key, features[i].count};
+   }
+   qsort(features, num_grams, sizeof *features, sb_cmp_hot);
+   return num_grams < SB_TRAIN_HOT ? num_grams : SB_TRAIN_HOT;
+}
+
+static void sb_trainer_write_hot(const struct sb_trainer *tr, FILE *fp,
+                                 const struct sb_entry *hot, size_t num_hot)
+{
+   if (tr->loaded) {
+      if (tr->num_hot)
+         fprintf(fp, "* %zu\n", tr->num_hot);
+      for (size_t i = 0; i < tr->num_hot; i++)
+         fprintf(fp, "%08" PRIx32 "\n", tr->hot[i]);
+      return;
+   }
+   if (num_hot)
+      fprintf(fp, "* %zu\n", num_hot);
+   for (size_t i = 0; i < num_hot; i++)
+      fprintf(fp, "%08" PRIx64 "\n", hot[i].key);
+}
+
+int sb_trainer_dump(const struct sb_trainer *tr, const char *path)
+{
+   if (!tr->num_labels)
+      return SB_ENOLANG;
+
+   /* Labels are written in lexicographic order. Those that don't have an
+    * identifier yet get the smallest unused ones, so that, for new models,
+    * identifiers are positions, as with sabir-train.
+    */
+   size_t order[SB_MAX_LABELS], rank[SB_MAX_LABELS];
+   int ids[SB_MAX_LABELS];
+   bool used[UINT8_MAX + 1] = {false};
+   for (size_t i = 0; i < tr->num_labels; i++) {
+      size_t j = i;
+      for ( ; j > 0 && tr->version == 2 && strcmp(tr->labels[order[j - 1]], tr->labels[i]) > 0; j--)
+         order[j] = order[j - 1];
+      order[j] = i;
+      ids[i] = tr->ids[i];
+      if (ids[i] >= 0)
+         used[ids[i]] = true;
+   }
+   int next_id = 0;
+   for (size_t k = 0; k < tr->num_labels; k++) {
+      size_t i = order[k];
+      rank[i] = k;
+      if (ids[i] < 0) {
+         while (used[next_id])
+            next_id++;
+         ids[i] = next_id++;
+      }
+   }
+
+   /* Sort features by quadgram. */
+   size_t num = 0;
+   struct sb_entry *features = malloc((tr->num_features + 1) * sizeof *features);
+   if (!features)
+      return SB_ENOMEM;
+   for (size_t i = 0; i <= tr->feature_mask; i++)
+      if (tr->features[i].key)
+         features[num++] = tr->features[i];
+   qsort(features, num, sizeof *features, sb_cmp_entries);
+
+   size_t table_size = tr->table_size;
+   if (!table_size) {
+      size_t num_distinct = num;
+      if (tr->sparse) {
+         num_distinct = 0;
+         for (size_t i = 0; i < num; i++)
+            num_distinct += !i || features[i].key >> 8 != features[i - 1].key >> 8;
+      }
+      table_size = sb_pow2_ceil(num_distinct);
+      if (table_size > SB_MAX_FEATURES)
+         table_size = SB_MAX_FEATURES;
+   }
+
+   /* Features table entries, keyed by "rank << 32 | bucket". */
+   size_t num_entries = 0;
+   struct sb_entry *entries = malloc((tr->num_base + num + 1) * sizeof *entries);
+   if (!entries) {
+      free(features);
+      return SB_ENOMEM;
+   }
+   for (size_t i = 0; i < tr->num_base; i++) {
+      uint64_t bucket = tr->base[i].key >> 8 & (table_size - 1);
+      size_t label = tr->base[i].key & 0xff;
+      entries[num_entries++] = (struct sb_entry){(uint64_t)rank[label] << 32 | bucket, tr->base[i].count};
+   }
+   for (size_t i = 0; i < num; i++) {
+      uint8_t gram[SB_NGRAM_SIZE];
+      for (size_t j = 0; j < SB_NGRAM_SIZE; j++)
+         gram[j] = features[i].key >> (8 + (SB_NGRAM_SIZE - 1 - j) * 8);
+      size_t label = features[i].key & 0xff;
+      uint32_t h = sb_hash_feature(gram, 0);
+      if (!tr->sparse)
+         h = sb_hash_lang(h, ids[label]);
+      uint64_t bucket = h & (table_size - 1);
+      entries[num_entries++] = (struct sb_entry){(uint64_t)rank[label] << 32 | bucket, features[i].count};
+   }
+   qsort(entries, num_entries, sizeof *entries, sb_cmp_entries);
+   size_t to = 0;
+   for (size_t i = 0; i < num_entries; i++) {
+      if (to && entries[to - 1].key == entries[i].key)
+         entries[to - 1].count += entries[i].count;
+      else
+         entries[to++] = entries[i];
+   }
+   num_entries = to;
+
+   /* Everything is allocated before the file is opened, so that it isn't
+    * left half written for lack of memory.
+    */
+   uint64_t *table = NULL;
+   size_t num_hot = 0;
+   if (tr->version == 1) {
+      table = calloc(table_size, sizeof *table);
+      if (!table) {
+         free(features);
+         free(entries);
+         return SB_ENOMEM;
+      }
+   } else if (!tr->loaded) {
+      num_hot = sb_trainer_sum_hot(features, num);
+   }
+
+   FILE *fp = fopen(path, "w");
+   if (!fp) {
+      free(features);
+      free(entries);
+      free(table);
+      return SB_EOPEN;
+   }
+   size_t labels_len = 0;
+   for (size_t i = 0; i < tr->num_labels; i++)
+      labels_len += strlen(tr->labels[i]);
+   fprintf(fp, "@ sabir %d\n", tr->version);
+   fprintf(fp, "> %zu %zu %zu%s\n", tr->num_labels, labels_len, table_size, tr->sparse ? " sparse" : "");
+   for (size_t k = 0; k < tr->num_labels; k++)
+      fprintf(fp, "%s\n", tr->labels[order[k]]);
+
+   if (tr->version == 1) {
+      /* A single table, summed over labels. */
+      for (size_t i = 0; i < num_entries; i++)
+         table[entries[i].key & UINT32_MAX] += entries[i].count;
+      for (size_t i = 0; i < table_size; i++)
+         fprintf(fp, "%" PRIu64 "\n", table[i]);
+   } else {
+      size_t start[SB_MAX_LABELS + 1] = {0};
+      for (size_t i = 0; i < num_entries; i++)
+         start[(entries[i].key >> 32) + 1]++;
+      for (size_t k = 0; k < tr->num_labels; k++) {
+         fprintf(fp, "= %d %zu\n", ids[order[k]], start[k + 1]);
+         start[k + 1] += start[k];
+      }
+      for (size_t i = 0; i < num_entries; i++)
+         fprintf(fp, "%" PRIu64 " %" PRIu64 "\n", entries[i].key & UINT32_MAX, entries[i].count);
+      if (!tr->loaded || tr->has_scripts)
+         for (size_t k = 0; k < tr->num_labels; k++)
+            sb_write_scripts(fp, sb_trainer_scripts(tr, order[k]));
+      sb_trainer_write_hot(tr, fp, features, num_hot);
+   }
+   free(features);
+   free(entries);
+   free(table);
+
+   int err = ferror(fp);
+   if (fclose(fp) || err)
+      return SB_EIO;
+   return SB_OK;
 }
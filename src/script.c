@@ -0,0 +1,116 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "script.h"
+
+static const char *const sb_script_names[] = {
+   [SB_ZYYY] = "Zyyy",
+   [SB_LATN] = "Latn", [SB_GREK] = "Grek", [SB_CYRL] = "Cyrl",
+   [SB_ARMN] = "Armn", [SB_HEBR] = "Hebr", [SB_ARAB] = "Arab",
+   [SB_DEVA] = "Deva", [SB_BENG] = "Beng", [SB_GURU] = "Guru",
+   [SB_GUJR] = "Gujr", [SB_ORYA] = "Orya", [SB_TAML] = "Taml",
+   [SB_TELU] = "Telu", [SB_KNDA] = "Knda", [SB_MLYM] = "Mlym",
+   [SB_SINH] = "Sinh", [SB_THAI] = "Thai", [SB_LAOO] = "Laoo",
+   [SB_TIBT] = "Tibt", [SB_MYMR] = "Mymr", [SB_GEOR] = "Geor",
+   [SB_HANG] = "Hang", [SB_ETHI] = "Ethi", [SB_KHMR] = "Khmr",
+   [SB_MONG] = "Mong", [SB_HIRA] = "Hira", [SB_KANA] = "Kana",
+   [SB_HANI] = "Hani",
+};
+
+/* Sorted, non-overlapping ranges. Code points that fall outside of them are
+ * assigned to SB_ZYYY.
+ */
+static const struct sb_script_range {
+   int32_t first, last;
+   int script;
+} sb_script_ranges[] = {
+   {0x0041, 0x005A, SB_LATN},    /* Basic Latin. */
+   {0x0061, 0x007A, SB_LATN},
+   {0x00AA, 0x00AA, SB_LATN},    /* Latin-1 Supplement. */
+   {0x00BA, 0x00BA, SB_LATN},
+   {0x00C0, 0x024F, SB_LATN},    /* Up to Latin Extended-B. */
+   {0x0250, 0x02AF, SB_LATN},    /* IPA Extensions. */
+   {0x0370, 0x03FF, SB_GREK},
+   {0x0400, 0x052F, SB_CYRL},    /* Cyrillic and Cyrillic Supplement. */
+   {0x0530, 0x058F, SB_ARMN},
+   {0x0590, 0x05FF, SB_HEBR},
+   {0x0600, 0x06FF, SB_ARAB},
+   {0x0750, 0x077F, SB_ARAB},    /* Arabic Supplement. */
+   {0x08A0, 0x08FF, SB_ARAB},    /* Arabic Extended-A. */
+   {0x0900, 0x097F, SB_DEVA},
+   {0x0980, 0x09FF, SB_BENG},
+   {0x0A00, 0x0A7F, SB_GURU},
+   {0x0A80, 0x0AFF, SB_GUJR},
+   {0x0B00, 0x0B7F, SB_ORYA},
+   {0x0B80, 0x0BFF, SB_TAML},
+   {0x0C00, 0x0C7F, SB_TELU},
+   {0x0C80, 0x0CFF, SB_KNDA},
+   {0x0D00, 0x0D7F, SB_MLYM},
+   {0x0D80, 0x0DFF, SB_SINH},
+   {0x0E00, 0x0E7F, SB_THAI},
+   {0x0E80, 0x0EFF, SB_LAOO},
+   {0x0F00, 0x0FFF, SB_TIBT},
+   {0x1000, 0x109F, SB_MYMR},
+   {0x10A0, 0x10FF, SB_GEOR},
+   {0x1100, 0x11FF, SB_HANG},    /* Hangul Jamo. */
+   {0x1200, 0x139F, SB_ETHI},    /* Ethiopic and Ethiopic Supplement. */
+   {0x1780, 0x17FF, SB_KHMR},
+   {0x1800, 0x18AF, SB_MONG},
+   {0x1C80, 0x1C8F, SB_CYRL},    /* Cyrillic Extended-C. */
+   {0x1C90, 0x1CBF, SB_GEOR},    /* Georgian Extended. */
+   {0x1D00, 0x1DBF, SB_LATN},    /* Phonetic Extensions. */
+   {0x1E00, 0x1EFF, SB_LATN},    /* Latin Extended Additional. */
+   {0x1F00, 0x1FFF, SB_GREK},    /* Greek Extended. */
+   {0x2C60, 0x2C7F, SB_LATN},    /* Latin Extended-C. */
+   {0x2D00, 0x2D2F, SB_GEOR},    /* Georgian Supplement. */
+   {0x2DE0, 0x2DFF, SB_CYRL},    /* Cyrillic Extended-A. */
+   {0x3040, 0x309F, SB_HIRA},
+   {0x30A0, 0x30FF, SB_KANA},
+   {0x3130, 0x318F, SB_HANG},    /* Hangul Compatibility Jamo. */
+   {0x31F0, 0x31FF, SB_KANA},    /* Katakana Phonetic Extensions. */
+   {0x3400, 0x4DBF, SB_HANI},    /* CJK Unified Ideographs Extension A. */
+   {0x4E00, 0x9FFF, SB_HANI},    /* CJK Unified Ideographs. */
+   {0xA640, 0xA69F, SB_CYRL},    /* Cyrillic Extended-B. */
+   {0xA720, 0xA7FF, SB_LATN},    /* Latin Extended-D. */
+   {0xA8E0, 0xA8FF, SB_DEVA},    /* Devanagari Extended. */
+   {0xAB30, 0xAB6F, SB_LATN},    /* Latin Extended-E. */
+   {0xAC00, 0xD7AF, SB_HANG},    /* Hangul Syllables. */
+   {0xF900, 0xFAFF, SB_HANI},    /* CJK Compatibility Ideographs. */
+   {0xFB50, 0xFDFF, SB_ARAB},    /* Arabic Presentation Forms-A. */
+   {0xFE70, 0xFEFF, SB_ARAB},    /* Arabic Presentation Forms-B. */
+   {0xFF21, 0xFF3A, SB_LATN},    /* Fullwidth Latin letters. */
+   {0xFF41, 0xFF5A, SB_LATN},
+   {0xFF66, 0xFF9F, SB_KANA},    /* Halfwidth Katakana. */
+   {0x20000, 0x3FFFF, SB_HANI},  /* Supplementary Ideographic Plane, etc. */
+};
+
+int sb_script(int32_t c)
+{
+   size_t lo = 0;
+   size_t hi = sizeof sb_script_ranges / sizeof *sb_script_ranges;
+
+   while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      const struct sb_script_range *r = &sb_script_ranges[mid];
+      if (c < r->first)
+         hi = mid;
+      else if (c > r->last)
+         lo = mid + 1;
+      else
+         return r->script;
+   }
+   return SB_ZYYY;
+}
+
+const char *sb_script_name(int script)
+{
+   return sb_script_names[script];
+}
+
+int sb_script_find(const char *name)
+{
+   for (int i = 0; i < SB_NUM_SCRIPTS; i++)
+      if (!strcmp(sb_script_names[i], name))
+         return i;
+   return -1;
+}
@@ -0,0 +1,32 @@
+#ifndef SB_SCRIPT_H
+#define SB_SCRIPT_H
+
+#include <stdint.h>
+
+/* Writing systems, named after their ISO 15924 code. This is a coarse
+ * classification, based on Unicode blocks rather than on the Unicode "Script"
+ * property, which utf8proc doesn't provide. SB_ZYYY stands for code points that
+ * are not assigned to any of the other scripts.
+ * The list must be kept in sync with the one in sabir-train.
+ */
+enum {
+   SB_ZYYY,
+   SB_LATN, SB_GREK, SB_CYRL, SB_ARMN, SB_HEBR, SB_ARAB, SB_DEVA, SB_BENG,
+   SB_GURU, SB_GUJR, SB_ORYA, SB_TAML, SB_TELU, SB_KNDA, SB_MLYM, SB_SINH,
+   SB_THAI, SB_LAOO, SB_TIBT, SB_MYMR, SB_GEOR, SB_HANG, SB_ETHI, SB_KHMR,
+   SB_MONG, SB_HIRA, SB_KANA, SB_HANI,
+   SB_NUM_SCRIPTS
+};
+
+/* Returns the script of a code point. */
+int sb_script(int32_t c);
+
+/* Returns the ISO 15924 code of a script. */
+const char *sb_script_name(int script);
+
+/* Returns the script that has the given ISO 15924 code, or -1 if there is no
+ * such script.
+ */
+int sb_script_find(const char *name);
+
+#endif
@@ -1,6 +1,8 @@
 #!/usr/bin/env python3
 
-import os, sys, imp, subprocess, random, codecs
+import os, sys, imp, random, math, copy
+from collections import Counter, defaultdict
+from ctypes import *
 
 NUM_TEST_DOCS = 100
 MAX_DOC_LEN = 600
@@ -10,37 +12,83 @@ this_dir = os.path.dirname(os.path.abspath(__file__))
 parent_dir = os.path.dirname(this_dir)
  
 sabir_py = imp.load_source("sabir-train", os.path.join(parent_dir, "sabir-train"))
-sabir_c = os.path.join(parent_dir, "sabir")
+# Must match the way the C library is compiled.
+sabir_py.FIXED_POINT = os.environ.get("SB_FIXED_POINT", "0") == "1"
+
+# The libraries of this directory are compiled with SB_DEBUG defined, for
+# tracing. See the Makefile.
+sabir_c = CDLL(os.path.join(this_dir, sabir_py.LIBRARIES[sabir_py.FIXED_POINT]))
+sabir_c.sb_detect.restype = c_char_p
+sabir_c.sb_finish.restype = c_char_p
+TRACE_FN = CFUNCTYPE(None, c_void_p, POINTER(c_ubyte), c_char_p, c_uint32, c_double)
 
 train_corpus = sabir_py.load_corpora(sys.argv[1:])
 
-def make_py_classifier():
-   classifier, _, _ = sabir_py.train_vector(train_corpus)
+def select_langs(counts, langs):
+   # Same as sb_load_subset(): the table is shrunk in proportion to the number
+   # of buckets of the retained languages, and folded.
+   total = sum(len(section) for section in counts.sections.values())
+   kept = sum(len(counts.sections[lang]) for lang in langs)
+   size = counts.size
+   if kept < total:
+      size = min(sabir_py.pow2_ceil(int(kept / total * size)), size)
+   subset = copy.copy(counts)
+   subset.size = size
+   subset.sections = {lang: sabir_py.fold(counts.sections[lang], size) for lang in langs}
+   return subset
+
+def make_py_classifier(langs=None):
+   counts = sabir_py.count_features(train_corpus)
+   if langs:
+      counts = select_langs(counts, langs)
+   classifier, _, _ = sabir_py.vector_classifier(counts)
    def classify(path):
       doc = list(sabir_py.iter_ngrams(path))
       guess, infos = classifier(doc)
       return infos, guess
    return classify
 
-def make_c_classifier():
+def make_c_classifier(langs=None):
    model = os.path.join(this_dir, "model.tmp")
    with open(model, "w") as fp:
       sabir_py.mkmodel(train_corpus, fp)
       pass
+   sb = c_void_p()
+   if langs:
+      langs = (c_char_p * (len(langs) + 1))(*(lang.encode() for lang in langs), None)
+   assert sabir_c.sb_load_subset(byref(sb), model.encode(), langs) == 0
+   infos = []
+   @TRACE_FN
+   def trace(arg, gram, lang, hash, prob):
+      infos.append((bytes(gram[:sabir_py.NGRAM_SIZE]), lang.decode(), hash, prob))
+   sabir_c.sb_set_trace(sb, trace, None)
    def classify(path):
-      p = subprocess.Popen([sabir_c, "-vm", model, path], stdout = subprocess.PIPE)
-      infos = []
-      for line in p.stdout:
-         fields = line.decode().strip().split()
-         if len(fields) == 1:
-            assert not p.stdout.readline()
-            return infos, fields[0]
-         else:
-            fields[0] = codecs.decode(fields[0], "hex")
-            fields[2] = int(fields[2])
-            fields[3] = float.fromhex(fields[3])
-            infos.append(tuple(fields))
-      raise Exception
+      with open(path, "rb") as fp:
+         text = fp.read()
+      infos.clear()
+      lang = sabir_c.sb_detect(sb, text, len(text)).decode()
+      return list(infos), lang
+   # Same, but we give quadgrams extracted by sabir-train, between quadgrams of
+   # zero bytes, which text can't give and which must be skipped.
+   def classify_grams(path):
+      zero = bytes(sabir_py.NGRAM_SIZE)
+      grams = zero + b"".join(gram + zero for gram in sabir_py.iter_ngrams(path))
+      infos.clear()
+      sabir_c.sb_init(sb)
+      sabir_c.sb_feed_grams(sb, grams, c_size_t(len(grams) // sabir_py.NGRAM_SIZE))
+      lang = sabir_c.sb_finish(sb).decode()
+      return list(infos), lang
+   classify.grams = classify_grams
+   # Same as classify(), in deduplication mode.
+   def classify_dedup(path):
+      sabir_c.sb_set_dedup(sb, 1)
+      try:
+         return classify(path)
+      finally:
+         sabir_c.sb_set_dedup(sb, 0)
+   classify.dedup = classify_dedup
+   # Must outlive the model.
+   classify.trace = trace
    return classify
 
 def make_doc(path):
@@ -52,24 +100,173 @@ def make_doc(path):
 def dump_ret(path, guessed_lang, infos):
    with open(os.path.join(this_dir, path), "w") as fp:
       for ngram, lang, hash, prob in infos:
-         prob = prob.hex()
+         prob = float(prob).hex()
          print("%r %s %d %s" % (ngram, lang, hash, prob), file=fp)
       print(guessed_lang, file=fp)
       
 
-py_classify = make_py_classifier()
-c_classify = make_c_classifier()
-
-path = os.path.join(this_dir, "doc.tmp")
-for n in range(1, NUM_TEST_DOCS + 1):
-   print("%d/%d" % (n, NUM_TEST_DOCS))
-   make_doc(path)
-   py_infos, py_lang = py_classify(path)
-   c_infos, c_lang = c_classify(path)
-   if py_lang != c_lang or py_infos != c_infos:
-      dump_ret("py_ret.tmp", py_lang, py_infos)
-      dump_ret("c_ret.tmp", c_lang, c_infos)
-      raise Exception("fail!")
+def check_dedup(infos, lang, dedup_infos, dedup_lang):
+   # In deduplication mode, each distinct quadgram is scored once per chunk,
+   # and its score multiplied by its number of occurrences. The last quadgram
+   # of a text is scored separately, so a quadgram can be reported twice, but
+   # with the same score. The sums must be the same as in the normal mode,
+   # exactly so with fixed-point scores, in which case the winner must be the
+   # same. With floating-point ones, it must be the same unless there is a
+   # near tie.
+   occurrences = Counter(infos)
+   if set(dedup_infos) != set(occurrences):
+      raise Exception("dedup: quadgrams differ!")
+   totals, dedup_totals = Counter(), Counter()
+   for info in infos:
+      totals[info[1]] += info[3]
+   for info in set(dedup_infos):
+      dedup_totals[info[1]] += info[3] * occurrences[info]
+   if sabir_py.FIXED_POINT:
+      if totals != dedup_totals or lang != dedup_lang:
+         raise Exception("dedup: scores differ!")
+      return
+   for label, total in totals.items():
+      if not math.isclose(total, dedup_totals[label], rel_tol=1e-12):
+         raise Exception("dedup: scores differ!")
+   if lang != dedup_lang and not math.isclose(totals[lang], totals[dedup_lang], rel_tol=1e-12):
+      raise Exception("dedup: winners differ!")
+
+def check_parity(name, langs=None):
+   # Random documents must be classified the same way by sabir-train and the
+   # C library, with the model settings currently in effect, and optionally
+   # with a subset of the languages.
+   py_classify = make_py_classifier(langs)
+   c_classify = make_c_classifier(langs)
+   path = os.path.join(this_dir, "doc.tmp")
+   for n in range(1, NUM_TEST_DOCS + 1):
+      print("%s %d/%d" % (name, n, NUM_TEST_DOCS))
+      make_doc(path)
+      py_infos, py_lang = py_classify(path)
+      c_infos, c_lang = c_classify(path)
+      if py_lang != c_lang or py_infos != c_infos:
+         dump_ret("py_ret.tmp", py_lang, py_infos)
+         dump_ret("c_ret.tmp", c_lang, c_infos)
+         raise Exception("fail!")
+      if c_classify.grams(path) != (c_infos, c_lang):
+         raise Exception("quadgrams classified differently!")
+      check_dedup(c_infos, c_lang, *c_classify.dedup(path))
+
+check_parity("hashed")
+sabir_py.LAYOUT = "sparse"
+check_parity("sparse")
+sabir_py.LAYOUT = "hashed"
+# Languages without a cluster form one of their own.
+sabir_py.CLUSTERS = {"de": "germanic", "en": "germanic", "fr": "romance", "it": "romance"}
+check_parity("clusters")
+sabir_py.CLUSTERS = {}
+check_parity("subset", ["en", "it"])
+
+# For cross-validation, counting all documents once and subtracting the counts
+# of a fold must give the same counts, and the same table size, as counting
+# all documents but the ones of this fold.
+fold_counts, fold_docs = sabir_py.count_folds(train_corpus)
+for fold_no in range(1, sabir_py.NUM_FOLDS + 1):
+   test_docs = defaultdict(list)
+   counts = sabir_py.count_features(train_corpus, fold_no, test_docs)
+   folded = fold_counts.finish(fold_no)
+   if (folded.size, folded.sections, folded.hot) != (counts.size, counts.sections, counts.hot):
+      raise Exception("fold %d counted differently!" % fold_no)
+   assert test_docs == fold_docs[fold_no]
+
+# The C trainer must count the same features as sabir-train, when given whole
+# files. Scripts are computed differently, so we don't compare them.
+trainer = c_void_p()
+assert sabir_c.sb_trainer_new(byref(trainer), 0, 0) == 0
+counts = sabir_py.Counts(sorted(os.path.basename(path) for path in sys.argv[1:]))
+for path in sys.argv[1:]:
+   with open(path, "rb") as fp:
+      text = fp.read()
+   lang = os.path.basename(path)
+   assert sabir_c.sb_trainer_feed(trainer, lang.encode(), text, len(text)) == 0
+for path in sys.argv[1:]:
+   counts.add(counts.langs.index(os.path.basename(path)), sabir_py.iter_ngrams(path))
+c_model = os.path.join(this_dir, "c_model.tmp")
+assert sabir_c.sb_trainer_dump(trainer, c_model.encode()) == 0
+sabir_c.sb_trainer_dealloc(trainer)
+py_model = os.path.join(this_dir, "py_model.tmp")
+with open(py_model, "w") as fp:
+   sabir_py.write_model(counts.finish(), {lang: [] for lang in counts.langs}, fp)
+with open(c_model) as c_fp, open(py_model) as py_fp:
+   if [l for l in c_fp if l[0] != "%"] != [l for l in py_fp if l[0] != "%"]:
+      raise Exception("trainers differ!")
+
+# Folding a model to a smaller table must give the same model as training at
+# that size.
+assert sabir_c.sb_trainer_load(byref(trainer), c_model.encode()) == 0
+sabir_c.sb_trainer_fold(trainer, c_size_t(4096))
+assert sabir_c.sb_trainer_dump(trainer, c_model.encode()) == 0
+sabir_c.sb_trainer_dealloc(trainer)
+sabir_py.BUCKETS = 4096
+with open(py_model, "w") as fp:
+   sabir_py.write_model(counts.finish(), {lang: [] for lang in counts.langs}, fp)
+with open(c_model) as c_fp, open(py_model) as py_fp:
+   if [l for l in c_fp if l[0] != "%"] != [l for l in py_fp if l[0] != "%"]:
+      raise Exception("folded model differs!")
+
+# Partial counts must add up: merging the counts of slices of the files must
+# give the same model as merging the counts of the whole files.
+def merge_model(num_shards):
+   paths = []
+   for path in sys.argv[1:]:
+      for shard_no in range(1, num_shards + 1):
+         paths.append(os.path.join(this_dir, "%s.%d.tmp" % (os.path.basename(path), shard_no)))
+         with open(paths[-1], "wb") as fp:
+            sabir_py.write_counts(path, shard_no, num_shards, fp)
+   with open(py_model, "w") as fp:
+      sabir_py.merge_counts(paths, fp)
+   with open(py_model) as fp:
+      return fp.read()
+
+if merge_model(1) != merge_model(7):
+   raise Exception("merged shards differ!")
+
+# Labels are chosen according to the scripts of the whole text, however it is
+# split into chunks. Labels whose letters all belong to the common script
+# (here, Tifinagh) can be written in any script.
+with open(next(path for path in sys.argv[1:] if os.path.basename(path) == "en")) as fp:
+   english = fp.read()
+russian = english.lower().translate(str.maketrans("abcdefghijklmnopqrstuvwxyz", "абцдефгхийклмнопярстувшхыз"))
+tifinagh = "ⵜⴰⵎⴰⵣⵉⵖⵜ ⵉⵎⵓⵀⴰⵖ ⴰⵣⵓⵍ ⴼⵍⴰⵡⵏ " * 500
+assert sabir_c.sb_trainer_new(byref(trainer), 0, 0) == 0
+for lang, text in (("en", english), ("ru", russian), ("tz", tifinagh)):
+   text = text.encode()
+   assert sabir_c.sb_trainer_feed(trainer, lang.encode(), text, len(text)) == 0
+assert sabir_c.sb_trainer_dump(trainer, c_model.encode()) == 0
+sabir_c.sb_trainer_dealloc(trainer)
+sb = c_void_p()
+assert sabir_c.sb_load(byref(sb), c_model.encode()) == 0
+text = ("Ok " + russian[:3000]).encode()
+assert sabir_c.sb_detect(sb, text, len(text)) == b"ru"
+sabir_c.sb_init(sb)
+for i in range(0, len(text), 3):
+   sabir_c.sb_feed(sb, text[i:], min(3, len(text) - i))
+assert sabir_c.sb_finish(sb) == b"ru"
+# Labels written in none of the scripts of the text are not scored at all by
+# sb_detect(), and only over the first letters of the text when it is fed in
+# chunks.
+reports = Counter()
+@TRACE_FN
+def count_reports(arg, gram, lang, hash, prob):
+   reports[lang.decode()] += 1
+sabir_c.sb_set_trace(sb, count_reports, None)
+text = russian[:3000].encode()
+assert sabir_c.sb_detect(sb, text, len(text)) == b"ru"
+assert reports["ru"] and not reports["en"]
+reports.clear()
+sabir_c.sb_init(sb)
+for i in range(0, len(text), 3):
+   sabir_c.sb_feed(sb, text[i:], min(3, len(text) - i))
+assert sabir_c.sb_finish(sb) == b"ru"
+assert 0 < reports["en"] < reports["ru"] / 4
+sabir_c.sb_set_trace(sb, None, None)
+text = (tifinagh[:100] + " ok").encode()
+assert sabir_c.sb_detect(sb, text, len(text)) == b"tz"
+sabir_c.sb_dealloc(sb)
 
 for file in os.listdir(this_dir):
    if file.endswith(".tmp"):
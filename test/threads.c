@@ -0,0 +1,301 @@
+/* Checks that models and results can be shared between threads:
+ *
+ *    test/threads <model> <text>..
+ *
+ * First, readers classify snippets of the given texts in a loop, through a
+ * live handle whose model a publisher keeps replacing. Then, several threads
+ * classify the same snippets through a result cache. In both cases, results
+ * must be the same as with a private model and no cache. This is meant to be
+ * compiled with AddressSanitizer (see the Makefile), so that models that are
+ * deallocated while still in use, or never deallocated, are caught too.
+ *
+ * The models published are subsets of the given one: the one with the first
+ * language, the one with the first two, etc. Readers can thus tell which model
+ * they got from its number of languages.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "../sabir.h"
+
+/* Maximum number of languages of a model, see SB_MAX_LABELS in the library. */
+#define MAX_LANGS 255
+
+#define NUM_SNIPPETS 256
+#define MAX_SNIPPET_LEN 200
+
+#define NUM_THREADS 4
+#define NUM_PUBLISHES 100
+
+/* Smaller than the number of snippets, so that entries get evicted. */
+#define CACHE_CAPACITY 64
+#define NUM_LOOKUPS 10000
+
+#define CHECK(cond) ((cond) ? (void)0 : fail(__LINE__, #cond))
+
+struct snippet {
+   const char *text;
+   size_t len;
+};
+
+static const char *model_path;
+static const char *const *langs;
+static size_t num_langs;
+
+static char *corpus;
+static struct snippet snippets[NUM_SNIPPETS];
+
+/* Models loaded privately, per number of languages, and their results. */
+static struct sabir *models[MAX_LANGS + 1];
+static const char *expected[MAX_LANGS + 1][NUM_SNIPPETS];
+
+static struct sb_live *live;
+static atomic_bool publishing;
+
+static struct sb_cache *cache;
+
+static void fail(int line, const char *what)
+{
+   fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, line, what);
+   exit(EXIT_FAILURE);
+}
+
+static struct sabir *load_model(size_t num)
+{
+   const char *subset[MAX_LANGS + 1];
+   memcpy(subset, langs, num * sizeof *subset);
+   subset[num] = NULL;
+
+   struct sabir *sb;
+   int ret = sb_load_subset(&sb, model_path, subset);
+   if (ret) {
+      fprintf(stderr, "cannot load %s: %s\n", model_path, sb_strerror(ret));
+      exit(EXIT_FAILURE);
+   }
+   return sb;
+}
+
+static struct sb_ctx *new_ctx(void)
+{
+   struct sb_ctx *ctx;
+   CHECK(sb_ctx_new(&ctx) == SB_OK);
+   return ctx;
+}
+
+/* Returns the number of languages of a model, and checks that the given
+ * language is one of them, and not a copy.
+ */
+static size_t check_lang(const struct sabir *sb, const char *lang)
+{
+   size_t num;
+   const char *const *labels = sb_langs(sb, &num);
+   size_t i = 0;
+   while (i < num && labels[i] != lang)
+      i++;
+   CHECK(i < num);
+   return num;
+}
+
+/* Takes snippets at pseudo-random offsets of the concatenation of the given
+ * files. Duplicates are avoided, since they would be cache hits.
+ */
+static void make_snippets(char **paths, size_t num_paths)
+{
+   size_t len = 0;
+   for (size_t i = 0; i < num_paths; i++) {
+      FILE *fp = fopen(paths[i], "rb");
+      if (!fp) {
+         perror(paths[i]);
+         exit(EXIT_FAILURE);
+      }
+      char buf[4096];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof buf, fp))) {
+         corpus = realloc(corpus, len + n);
+         CHECK(corpus);
+         memcpy(&corpus[len], buf, n);
+         len += n;
+      }
+      fclose(fp);
+   }
+   CHECK(len > MAX_SNIPPET_LEN);
+
+   uint32_t state = 1;
+   for (size_t i = 0; i < NUM_SNIPPETS; ) {
+      struct snippet *s = &snippets[i];
+      state = state * 1103515245 + 12345;
+      s->text = &corpus[(state >> 8) % (len - MAX_SNIPPET_LEN)];
+      s->len = 1 + (state >> 4) % MAX_SNIPPET_LEN;
+      size_t j = 0;
+      while (j < i && (snippets[j].len != s->len || memcmp(snippets[j].text, s->text, s->len)))
+         j++;
+      if (j == i)
+         i++;
+   }
+}
+
+static int read_live(void *arg)
+{
+   struct sb_ctx *ctx = new_ctx();
+   (void)arg;
+
+   for (size_t i = 0; atomic_load(&publishing) || i < NUM_SNIPPETS; i++) {
+      const struct sabir *sb = sb_live_acquire(live);
+      const struct snippet *s = &snippets[i % NUM_SNIPPETS];
+      const char *lang = sb_ctx_detect(ctx, sb, s->text, s->len);
+      size_t num = check_lang(sb, lang);
+      CHECK(!strcmp(lang, expected[num][i % NUM_SNIPPETS]));
+      sb_live_release(sb);
+   }
+   sb_ctx_dealloc(ctx);
+   return 0;
+}
+
+static void test_live(void)
+{
+   CHECK(sb_live_new(&live, load_model(num_langs)) == SB_OK);
+
+   /* Hold the first model until all the others have been published. */
+   const struct sabir *held = sb_live_acquire(live);
+
+   thrd_t readers[NUM_THREADS];
+   atomic_store(&publishing, true);
+   for (size_t t = 0; t < NUM_THREADS; t++)
+      CHECK(thrd_create(&readers[t], read_live, NULL) == thrd_success);
+   for (size_t i = 0; i < NUM_PUBLISHES; i++) {
+      sb_live_publish(live, load_model(i % num_langs + 1));
+      thrd_yield();
+   }
+   atomic_store(&publishing, false);
+   for (size_t t = 0; t < NUM_THREADS; t++)
+      CHECK(thrd_join(readers[t], NULL) == thrd_success);
+
+   /* The held model must still be usable. */
+   struct sb_ctx *ctx = new_ctx();
+   for (size_t i = 0; i < NUM_SNIPPETS; i++) {
+      const char *lang = sb_ctx_detect(ctx, held, snippets[i].text, snippets[i].len);
+      CHECK(check_lang(held, lang) == num_langs);
+      CHECK(!strcmp(lang, expected[num_langs][i]));
+   }
+   sb_ctx_dealloc(ctx);
+   sb_live_release(held);
+
+   sb_live_dealloc(live);
+}
+
+/* Classifies a snippet through the cache with the model that has the given
+ * number of languages, and checks the result.
+ */
+static void lookup(struct sb_ctx *ctx, size_t num, size_t n)
+{
+   const char *lang = sb_cache_detect(cache, ctx, models[num], snippets[n].text, snippets[n].len);
+   CHECK(check_lang(models[num], lang) == num);
+   CHECK(!strcmp(lang, expected[num][n]));
+}
+
+static void check_stats(size_t hits, size_t misses)
+{
+   size_t cur_hits, cur_misses;
+   sb_cache_stats(cache, &cur_hits, &cur_misses);
+   CHECK(cur_hits == hits && cur_misses == misses);
+}
+
+static int read_cache(void *arg)
+{
+   struct sb_ctx *ctx = new_ctx();
+   size_t t = *(size_t *)arg;
+
+   /* Each thread goes through the snippets in its own order. */
+   for (size_t i = 0; i < NUM_LOOKUPS; i++)
+      lookup(ctx, num_langs, (i * (2 * t + 1) + t) % NUM_SNIPPETS);
+   sb_ctx_dealloc(ctx);
+   return 0;
+}
+
+static void test_cache(void)
+{
+   struct sb_ctx *ctx = new_ctx();
+
+   /* Hits and misses. The cache is shared between models, but results are
+    * specific to each of them. The cache is made as small as possible, so that
+    * all entries end up in the same set.
+    */
+   CHECK(sb_cache_new(&cache, 1) == SB_OK);
+   lookup(ctx, num_langs, 0);
+   check_stats(0, 1);
+   lookup(ctx, num_langs, 0);
+   check_stats(1, 1);
+   for (size_t num = 1; num < num_langs; num++)
+      lookup(ctx, num, 0);
+   check_stats(1, num_langs);
+   sb_cache_dealloc(cache);
+
+   /* Eviction. The first snippet is looked up after each new one, so it must
+    * remain in the cache, whereas older new ones must not.
+    */
+   CHECK(sb_cache_new(&cache, 1) == SB_OK);
+   for (size_t i = 1; i < NUM_SNIPPETS; i++) {
+      lookup(ctx, num_langs, i);
+      lookup(ctx, num_langs, 0);
+   }
+   check_stats(NUM_SNIPPETS - 2, NUM_SNIPPETS);
+   lookup(ctx, num_langs, 1);
+   check_stats(NUM_SNIPPETS - 2, NUM_SNIPPETS + 1);
+   sb_cache_dealloc(cache);
+   sb_ctx_dealloc(ctx);
+
+   /* Concurrent lookups. */
+   CHECK(sb_cache_new(&cache, CACHE_CAPACITY) == SB_OK);
+   thrd_t readers[NUM_THREADS];
+   size_t nos[NUM_THREADS];
+   for (size_t t = 0; t < NUM_THREADS; t++) {
+      nos[t] = t;
+      CHECK(thrd_create(&readers[t], read_cache, &nos[t]) == thrd_success);
+   }
+   for (size_t t = 0; t < NUM_THREADS; t++)
+      CHECK(thrd_join(readers[t], NULL) == thrd_success);
+   size_t hits, misses;
+   sb_cache_stats(cache, &hits, &misses);
+   CHECK(hits + misses == NUM_THREADS * NUM_LOOKUPS);
+   CHECK(hits > 0 && misses >= NUM_SNIPPETS);
+   sb_cache_dealloc(cache);
+}
+
+int main(int argc, char **argv)
+{
+   if (argc < 3) {
+      fprintf(stderr, "Usage: %s <model> <text>..\n", *argv);
+      return EXIT_FAILURE;
+   }
+   model_path = argv[1];
+   make_snippets(&argv[2], argc - 2);
+
+   struct sabir *all;
+   int ret = sb_load(&all, model_path);
+   if (ret) {
+      fprintf(stderr, "cannot load %s: %s\n", model_path, sb_strerror(ret));
+      return EXIT_FAILURE;
+   }
+   langs = sb_langs(all, &num_langs);
+
+   struct sb_ctx *ctx = new_ctx();
+   for (size_t num = 1; num <= num_langs; num++) {
+      models[num] = load_model(num);
+      for (size_t i = 0; i < NUM_SNIPPETS; i++)
+         expected[num][i] = sb_ctx_detect(ctx, models[num], snippets[i].text, snippets[i].len);
+   }
+   sb_ctx_dealloc(ctx);
+
+   test_live();
+   test_cache();
+
+   for (size_t num = 1; num <= num_langs; num++)
+      sb_dealloc(models[num]);
+   sb_dealloc(all);
+   free(corpus);
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,12 @@
+#!/usr/bin/env sh
+
+# Shares models and results between threads, see test/threads.c.
+
+set -o errexit
+
+./sabir-train dump test/data/* > test/model.tmp
+test/threads test/model.tmp test/data/*
+
+rm test/model.tmp
+
+exit 0
@@ -0,0 +1,350 @@
+/* We include the library source for the "stats" command, which needs to look
+ * at the raw counts kept by the trainer, and at the type of scores.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "../sabir.c"
+#include "../cmd/cmd.h"
+
+static const char help[] =
+   #include "model.ih"
+;
+
+/* Returns the name of the language of a text file: its base name, stripped
+ * of its extension, as in sabir-train.
+ */
+static char *lang_of(const char *path)
+{
+   const char *base = strrchr(path, '/');
+   base = base ? base + 1 : path;
+   const char *ext = strrchr(base, '.');
+   size_t len = ext && ext != base ? (size_t)(ext - base) : strlen(base);
+
+   char *lang = malloc(len + 1);
+   if (!lang)
+      die("out of memory");
+   memcpy(lang, base, len);
+   lang[len] = '\0';
+   return lang;
+}
+
+/* Classifies each non-empty line of the given files with a model. Returns the
+ * number of lines whose language was found, and fills "total" with the number
+ * of lines classified.
+ */
+static size_t classify_lines(struct sabir *sb, int nr, char **files, size_t *total)
+{
+   size_t correct = 0;
+   char *line = NULL;
+   size_t size = 0;
+
+   *total = 0;
+   for (int i = 0; i < nr; i++) {
+      FILE *fp = fopen(files[i], "r");
+      if (!fp)
+         die("cannot open '%s':", files[i]);
+      char *lang = lang_of(files[i]);
+      ssize_t len;
+      while ((len = getline(&line, &size, fp)) > 0) {
+         if (len == 1 && *line == '\n')
+            continue;
+         correct += !strcmp(sb_detect(sb, line, len), lang);
+         ++*total;
+      }
+      if (ferror(fp))
+         die("cannot read '%s':", files[i]);
+      free(lang);
+      fclose(fp);
+   }
+   free(line);
+   return correct;
+}
+
+static struct sabir *load(const char *path)
+{
+   struct sabir *sb;
+   int ret = sb_load(&sb, path);
+   if (ret)
+      die("cannot load model from '%s': %s", path, sb_strerror(ret));
+   return sb;
+}
+
+static void shrink(int argc, char **argv)
+{
+   size_t buckets = 0;
+   struct option opts[] = {
+      {'b', "buckets", OPT_SIZE_T(buckets)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc < 2)
+      die("missing argument");
+   if (!buckets || (buckets & (buckets - 1)))
+      die("the number of buckets must be a power of two");
+
+   const char *input = argv[0], *output = argv[1];
+   struct sb_trainer *tr;
+   int ret = sb_trainer_load(&tr, input);
+   if (ret)
+      die("cannot load model from '%s': %s", input, sb_strerror(ret));
+   if (buckets >= sb_trainer_buckets(tr))
+      die("the model already has %zu buckets", sb_trainer_buckets(tr));
+   sb_trainer_fold(tr, buckets);
+   ret = sb_trainer_dump(tr, output);
+   if (ret)
+      die("cannot write model to '%s': %s", output, sb_strerror(ret));
+   sb_trainer_dealloc(tr);
+
+   if (argc == 2)
+      return;
+
+   struct sabir *before = load(input), *after = load(output);
+   size_t total, ok_before, ok_after;
+   ok_before = classify_lines(before, argc - 2, argv + 2, &total);
+   ok_after = classify_lines(after, argc - 2, argv + 2, &total);
+   if (total)
+      printf("accuracy: %.3f -> %.3f (%zu lines)\n", 100. * ok_before / total,
+             100. * ok_after / total, total);
+   sb_dealloc(before);
+   sb_dealloc(after);
+}
+
+/* Cache budget assumed by "stats", in KiB, if none is given. */
+#define DEFAULT_CACHE 1024
+
+/* Smallest table size considered when looking for one that fits in the cache
+ * budget.
+ */
+#define MIN_BUCKETS 1024
+
+/* Number of histogram bins for counts. Bin "i" holds counts in [2^i, 2^(i+1)).
+ */
+#define NUM_BINS 64
+
+/* Estimates the number of distinct features hashed into a table of "size"
+ * buckets, given the number of non-empty buckets. If features are hashed
+ * uniformly, we expect "size * (1 - exp(-n / size))" of them to be non-empty.
+ */
+static double estimate_features(size_t occupied, size_t size)
+{
+   if (occupied >= size)
+      return INFINITY;
+   return -(double)size * log1p(-(double)occupied / size);
+}
+
+/* Returns the expected fraction of "n" features that share their bucket with
+ * another one, in a table of "size" buckets.
+ */
+static double collision_rate(double n, size_t size)
+{
+   return n ? -expm1(-n / size) : 0;
+}
+
+/* Same for a sparse table, where only features of the same label collide.
+ * "features" holds the estimated number of features of each label.
+ */
+static double sparse_collision_rate(const double *features, size_t num_labels, size_t size)
+{
+   double total = 0, colliding = 0;
+
+   for (size_t i = 0; i < num_labels; i++) {
+      total += features[i];
+      colliding += features[i] * collision_rate(features[i], size);
+   }
+   return total ? colliding / total : 0;
+}
+
+/* Returns the number of bytes taken by a features table of "size" buckets,
+ * with scores of "score_size" bytes, and its expected collision rate.
+ */
+static size_t table_bytes(const struct sb_trainer *tr, const double *features,
+                          double num_features, size_t size, size_t score_size,
+                          double *collisions)
+{
+   if (!tr->sparse) {
+      *collisions = collision_rate(num_features, size);
+      return size * score_size;
+   }
+   double entries = 0;
+   for (size_t i = 0; i < tr->num_labels; i++)
+      entries -= size * expm1(-features[i] / size);
+   *collisions = sparse_collision_rate(features, tr->num_labels, size);
+   return (size + 1) * sizeof(uint32_t) + ((size_t)entries + 1) * (1 + score_size);
+}
+
+static double percent(double x, double total)
+{
+   return total ? 100 * x / total : 0;
+}
+
+static void stats(int argc, char **argv)
+{
+   size_t cache = DEFAULT_CACHE;
+   struct option opts[] = {
+      {'c', "cache", OPT_SIZE_T(cache)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
+
+   struct sb_trainer *tr;
+   int ret = sb_trainer_load(&tr, argv[0]);
+   if (ret)
+      die("cannot load model from '%s': %s", argv[0], sb_strerror(ret));
+
+   size_t size = tr->table_size, num_labels = tr->num_labels;
+   bool by_label = tr->version > 1;
+   qsort(tr->base, tr->num_base, sizeof *tr->base, sb_cmp_entries);
+
+   /* Entries are sorted by bucket, then label. */
+   size_t occupied = 0, bins[NUM_BINS] = {0};
+   size_t label_entries[SB_MAX_LABELS] = {0};
+   double label_mass[SB_MAX_LABELS] = {0}, mass = 0, postings = 0;
+   for (size_t i = 0, j; i < tr->num_base; i = j) {
+      size_t bucket = tr->base[i].key >> 8;
+      double bucket_mass = 0;
+      for (j = i; j < tr->num_base && tr->base[j].key >> 8 == bucket; j++) {
+         uint64_t count = tr->base[j].count;
+         size_t label = tr->base[j].key & 0xff;
+         label_entries[label]++;
+         label_mass[label] += count;
+         bucket_mass += count;
+         int bin = 0;
+         while (count >>= 1)
+            bin++;
+         bins[bin]++;
+      }
+      occupied++;
+      mass += bucket_mass;
+      postings += bucket_mass * (j - i);
+   }
+
+   printf("model: %s (version %d, %s layout)\n", argv[0], tr->version,
+          tr->sparse ? "sparse" : "hashed");
+   printf("labels: %zu\n", num_labels);
+   printf("buckets: %zu\n", size);
+   printf("occupancy: %zu buckets (%.2f%%), zero fraction %.2f%%\n", occupied,
+          percent(occupied, size), 100 - percent(occupied, size));
+   printf("entries: %zu\n", tr->num_base);
+
+   /* The number of distinct features is estimated from the occupancy of the
+    * table, per label with the sparse layout, since the features of distinct
+    * labels don't collide then.
+    */
+   double features[SB_MAX_LABELS] = {0}, num_features, collisions;
+   if (tr->sparse) {
+      num_features = 0;
+      for (size_t i = 0; i < num_labels; i++)
+         num_features += features[i] = estimate_features(label_entries[i], size);
+      collisions = sparse_collision_rate(features, num_labels, size);
+   } else {
+      num_features = estimate_features(occupied, size);
+      collisions = collision_rate(num_features, size);
+   }
+   printf("estimated features: %.0f\n", num_features);
+   printf("estimated collision rate: %.2f%%\n", 100 * collisions);
+
+   /* Bytes read per quadgram, when all labels are scored. With the hashed
+    * layout, each label is looked up in a distinct, random cache line. With
+    * the sparse layout, we read two offsets, then the labels and scores of a
+    * posting list, whose expected length is weighted by counts, since
+    * frequent quadgrams are looked up more often.
+    */
+   size_t score_size = sizeof(sb_score);
+   printf("score size: %zu bytes\n", score_size);
+   if (tr->sparse) {
+      size_t bytes = (size + 1) * sizeof(uint32_t) + (tr->num_base + 1) * (1 + score_size);
+      double len = mass ? postings / mass : 0;
+      printf("table memory: %.1f KiB\n", bytes / 1024.);
+      printf("bytes per quadgram: %.1f (%d cache lines)\n",
+             2 * sizeof(uint32_t) + len * (1 + score_size), len ? 3 : 1);
+   } else {
+      printf("table memory: %.1f KiB\n", size * score_size / 1024.);
+      printf("bytes per quadgram: %zu (%zu cache lines)\n",
+             num_labels * score_size, num_labels);
+   }
+   if (tr->num_hot) {
+      size_t slots = sb_pow2_ceil(2 * tr->num_hot);
+      printf("hot quadgrams: %zu (%.1f KiB), %zu bytes per hit\n", tr->num_hot,
+             slots * (sizeof(uint32_t) + num_labels * score_size) / 1024.,
+             sizeof(uint32_t) + num_labels * score_size);
+   }
+
+   printf("\ncounts:\n");
+   for (int i = 0; i < NUM_BINS; i++) {
+      if (!bins[i])
+         continue;
+      uint64_t lo = (uint64_t)1 << i, hi = (lo << 1) - 1;
+      char range[64];
+      if (lo == hi)
+         snprintf(range, sizeof range, "%" PRIu64, lo);
+      else
+         snprintf(range, sizeof range, "%" PRIu64 "-%" PRIu64, lo, hi);
+      printf("   %-21s %10zu %6.2f%%\n", range, bins[i], percent(bins[i], tr->num_base));
+   }
+
+   if (by_label) {
+      printf("\nlanguages:\n");
+      for (size_t i = 0; i < num_labels; i++)
+         printf("   %-10s %10zu entries %14.0f counts %6.2f%%\n", tr->labels[i],
+                label_entries[i], label_mass[i], percent(label_mass[i], mass));
+   }
+
+   /* Find the largest table that fits in the budget, for each score type the
+    * library can be compiled with, and recommend the one with the fewest
+    * collisions. Tables are never grown, since we can't unfold them.
+    */
+   static const struct {
+      size_t size;
+      const char *name, *how;
+   } types[] = {
+      {sizeof(double), "floating-point", "the default"},
+      {sizeof(uint32_t), "fixed-point", "make FIXED_POINT=1"},
+   };
+   size_t budget = cache * 1024, best_size = 0;
+   double best_collisions = 1;
+   size_t best_type = SIZE_MAX;
+   printf("\ncache budget: %zu KiB\n", cache);
+   for (size_t t = 0; t < sizeof types / sizeof *types; t++) {
+      size_t fit = 0;
+      double fit_collisions = 1;
+      for (size_t n = size; n >= MIN_BUCKETS; n /= 2) {
+         if (table_bytes(tr, features, num_features, n, types[t].size, &fit_collisions) <= budget) {
+            fit = n;
+            break;
+         }
+      }
+      if (!fit) {
+         printf("   %s scores: no table fits\n", types[t].name);
+         continue;
+      }
+      printf("   %s scores: %zu buckets, estimated collision rate %.2f%%\n",
+             types[t].name, fit, 100 * fit_collisions);
+      if (fit_collisions < best_collisions) {
+         best_collisions = fit_collisions;
+         best_size = fit;
+         best_type = t;
+      }
+   }
+   if (best_type == SIZE_MAX)
+      printf("recommended: a larger cache budget, or fewer labels\n");
+   else if (best_size == size)
+      printf("recommended: keep %zu buckets, with %s scores rather than %s ones (%s)\n",
+             size, types[best_type].name, types[!best_type].name, types[best_type].how);
+   else
+      printf("recommended: sabir-model shrink -b %zu, with %s scores rather than %s ones (%s)\n",
+             best_size, types[best_type].name, types[!best_type].name, types[best_type].how);
+
+   sb_trainer_dealloc(tr);
+}
+
+int main(int argc, char **argv)
+{
+   struct command cmds[] = {
+      {"shrink", shrink},
+      {"stats", stats},
+      {NULL},
+   };
+   parse_command(cmds, help, argc, argv);
+}